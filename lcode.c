@@ -256,7 +256,7 @@ int luaK_stringK (FuncState *fs, TString *s) {
 
 int luaK_numberK (FuncState *fs, lua_Number r) {
   TValue o;
-  setnvalue(&o, r);
+  setnumvalue(&o, r);
   return addk(fs, &o, &o);
 }
 
@@ -829,3 +829,40 @@ void luaK_setlist (FuncState *fs, int base, int nelems, int tostore) {
   fs->freereg = base + 1;  /* free registers with list values */
 }
 
+
+/*
+** Turn the first instruction of frequent pairs into its fused opcode (see
+** lopcodes.h), saving one dispatch each time the pair runs. The second
+** instruction is left untouched, so jumps into the pair stay valid.
+*/
+void luaK_fuse (FuncState *fs) {
+  Proto *f = fs->f;
+  int pc;
+  for (pc = 0; pc + 1 < fs->pc; pc++) {
+    Instruction *i = &f->code[pc];
+    OpCode next = GET_OPCODE(f->code[pc+1]);
+    switch (GET_OPCODE(*i)) {
+      case OP_GETGLOBAL: {
+        if (next == OP_GETTABLE) SET_OPCODE(*i, OP_GLOBALFIELD);
+        break;
+      }
+      case OP_GETUPVAL: {
+        if (next == OP_GETTABLE) SET_OPCODE(*i, OP_UPVALFIELD);
+        break;
+      }
+      case OP_SELF: {
+        if (next == OP_CALL) SET_OPCODE(*i, OP_SELFCALL);
+        break;
+      }
+      case OP_SETLIST: {
+        if (GETARG_C(*i) == 0) pc++;  /* skip the real C */
+        break;
+      }
+      case OP_CLOSURE: {
+        pc += f->p[GETARG_Bx(*i)]->nups;  /* skip upvalue pseudo-instructions */
+        break;
+      }
+      default: break;
+    }
+  }
+}
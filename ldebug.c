@@ -363,6 +363,11 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
         break;
       }
     }
+    if (isfused(op)) {  /* the VM runs the next instruction as `fusednext' */
+      check(pc+1 < pt->sizecode);
+      check(GET_OPCODE(pt->code[pc+1]) == fusednext(op));
+      op = cast(OpCode, fusedbase(op));
+    }
     if (testAMode(op)) {
       if (a == reg) last = pc;  /* change register `a' */
     }
@@ -506,7 +511,8 @@ static const char *getobjname (lua_State *L, CallInfo *ci, int stackpos,
     i = symbexec(p, pc, stackpos);  /* try symbolic execution */
     lua_assert(pc != -1);
     switch (GET_OPCODE(i)) {
-      case OP_GETGLOBAL: {
+      case OP_GETGLOBAL:
+      case OP_GLOBALFIELD: {
         int g = GETARG_Bx(i);  /* global index */
         lua_assert(ttisstring(&p->k[g]));
         *name = svalue(&p->k[g]);
@@ -524,12 +530,14 @@ static const char *getobjname (lua_State *L, CallInfo *ci, int stackpos,
         *name = kname(p, k);
         return "field";
       }
-      case OP_GETUPVAL: {
+      case OP_GETUPVAL:
+      case OP_UPVALFIELD: {
         int u = GETARG_B(i);  /* upvalue index */
         *name = p->upvalues ? getstr(p->upvalues[u]) : "?";
         return "upvalue";
       }
-      case OP_SELF: {
+      case OP_SELF:
+      case OP_SELFCALL: {
         int k = GETARG_C(i);  /* key index */
         *name = kname(p, k);
         return "method";
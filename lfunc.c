@@ -16,6 +16,7 @@
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 
 
@@ -134,6 +135,10 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->ic = NULL;
+  f->sizeic = 0;
+  f->gcache = NULL;
+  f->sizegcache = 0;
   return f;
 }
 
@@ -145,10 +150,52 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
   luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
   luaM_freearray(L, f->upvalues, f->sizeupvalues, TString *);
+  luaM_freearray(L, f->ic, f->sizeic, ICache);
+  luaM_freearray(L, f->gcache, f->sizegcache, GCache);
   luaM_free(L, f);
 }
 
 
+/*
+** give `f' its caches once its code and constants are final: inline
+** caches if a GETTABLE, SETTABLE or SELF has a constant string key, and
+** global caches if it reads or writes globals
+*/
+void luaF_initcache (lua_State *L, Proto *f) {
+  int pc, fields = 0, globals = 0;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    int key;
+    switch (GET_OPCODE(i)) {
+      case OP_GETTABLE: case OP_SELF: case OP_SELFCALL:
+        key = GETARG_C(i); break;
+      case OP_SETTABLE: key = GETARG_B(i); break;
+      case OP_GETGLOBAL: case OP_SETGLOBAL: case OP_GLOBALFIELD:
+        globals = 1; continue;
+      default: continue;
+    }
+    if (ISK(key) && INDEXK(key) < f->sizek && ttisstring(&f->k[INDEXK(key)]))
+      fields = 1;
+  }
+  if (fields) {
+    f->ic = luaM_newvector(L, f->sizecode, ICache);
+    f->sizeic = f->sizecode;
+    for (pc = 0; pc < f->sizeic; pc++) {
+      f->ic[pc].node = NULL;  /* matches no table */
+      f->ic[pc].slot = 0;
+    }
+  }
+  if (globals) {
+    f->gcache = luaM_newvector(L, f->sizek, GCache);
+    f->sizegcache = f->sizek;
+    for (pc = 0; pc < f->sizegcache; pc++) {
+      f->gcache[pc].version = 0;  /* tables start at version 1 */
+      f->gcache[pc].value = NULL;
+    }
+  }
+}
+
+
 void luaF_freeclosure (lua_State *L, Closure *c) {
   int size = (c->c.isC) ? sizeCclosure(c->c.nupvalues) :
                           sizeLclosure(c->l.nupvalues);
@@ -61,6 +61,7 @@ typedef union {
   void *p;
   lua_Number n;
   int b;
+  int i;  /* number with the integer subtype */
 } Value;
 
 
@@ -86,11 +87,27 @@ typedef struct lua_TValue {
 #define ttisthread(o)	(ttype(o) == LUA_TTHREAD)
 #define ttislightuserdata(o)	(ttype(o) == LUA_TLIGHTUSERDATA)
 
-/* Macros to access values */
+/*
+** With LUA_USE_INTSUBTYPE a number that holds an `int' may be kept as one:
+** its tag is LUA_TNUMBER plus INTBIT and the value lives in `value.i'.
+** ttype masks INTBIT, so the rest of the core sees a plain number, and
+** nvalue converts. Only fast paths look at the subtype.
+*/
+#if defined(LUA_USE_INTSUBTYPE)
+#define INTBIT		(1 << 4)
+#define ttype(o)	((o)->tt & ~INTBIT)
+#define ttisint(o)	((o)->tt == (LUA_TNUMBER | INTBIT))
+#else
 #define ttype(o)	((o)->tt)
+#define ttisint(o)	0
+#endif
+
+/* Macros to access values */
 #define gcvalue(o)	check_exp(iscollectable(o), (o)->value.gc)
 #define pvalue(o)	check_exp(ttislightuserdata(o), (o)->value.p)
-#define nvalue(o)	check_exp(ttisnumber(o), (o)->value.n)
+#define nvalue(o)	check_exp(ttisnumber(o), \
+			  ttisint(o) ? cast_num((o)->value.i) : (o)->value.n)
+#define ivalue(o)	check_exp(ttisint(o), (o)->value.i)
 #define rawtsvalue(o)	check_exp(ttisstring(o), &(o)->value.gc->ts)
 #define tsvalue(o)	(&rawtsvalue(o)->tsv)
 #define rawuvalue(o)	check_exp(ttisuserdata(o), &(o)->value.gc->u)
@@ -119,6 +136,27 @@ typedef struct lua_TValue {
 #define setnvalue(obj,x) \
   { TValue *i_o=(obj); i_o->value.n=(x); i_o->tt=LUA_TNUMBER; }
 
+#if defined(LUA_USE_INTSUBTYPE)
+#define setivalue(obj,x) \
+  { TValue *i_o=(obj); i_o->value.i=(x); i_o->tt=LUA_TNUMBER|INTBIT; }
+
+/*
+** true when `n', after lua_number2int(i, n), is that int; -0 is not, as
+** an int would lose its sign
+*/
+#define isintnum(i,n)	(luai_numeq(cast_num(i), (n)) && \
+			 ((i) != 0 || luai_numlt(0, luai_numdiv(1, (n)))))
+
+/* a number, with the integer subtype when it holds an int */
+#define setnumvalue(obj,x) \
+  { lua_Number n_ = (x); int k_; lua_number2int(k_, n_); \
+    if (isintnum(k_, n_)) setivalue(obj, k_) else setnvalue(obj, n_); }
+#else
+#define setivalue(obj,x)	setnvalue(obj, cast_num(x))
+#define isintnum(i,n)		0
+#define setnumvalue(obj,x)	setnvalue(obj,x)
+#endif
+
 #define setpvalue(obj,x) \
   { TValue *i_o=(obj); i_o->value.p=(x); i_o->tt=LUA_TLIGHTUSERDATA; }
 
@@ -183,7 +221,7 @@ typedef struct lua_TValue {
 #define setobj2n	setobj
 #define setsvalue2n	setsvalue
 
-#define setttype(obj, tt) (ttype(obj) = (tt))
+#define setttype(obj, t) ((obj)->tt = (t))
 
 
 #define iscollectable(o)	(ttype(o) >= LUA_TSTRING)
@@ -228,6 +266,28 @@ typedef union Udata {
 /*
 ** Function Prototypes
 */
+
+/*
+** inline cache of one GETTABLE, SETTABLE or SELF with a constant string
+** key: the node array of the table it last indexed and the key's node
+*/
+typedef struct ICache {
+  const struct Node *node;
+  int slot;
+} ICache;
+
+
+/*
+** cache of one global name read by GETGLOBAL or written by SETGLOBAL:
+** where its value sits in the environment, valid while the environment
+** keeps the same `version'
+*/
+typedef struct GCache {
+  lu_mem version;
+  TValue *value;
+} GCache;
+
+
 typedef struct Proto {
   CommonHeader;
   TValue *k;  /* constants used by the function */
@@ -237,6 +297,10 @@ typedef struct Proto {
   struct LocVar *locvars;  /* information about local variables */
   TString **upvalues;  /* upvalue names */
   TString  *source;
+  ICache *ic;  /* one per instruction, or NULL (see luaF_initcache) */
+  GCache *gcache;  /* one per constant, or NULL */
+  int sizeic;
+  int sizegcache;
   int sizeupvalues;
   int sizek;  /* size of `k' */
   int sizecode;
@@ -345,6 +409,7 @@ typedef struct Table {
   Node *lastfree;  /* any free position is before this position */
   GCObject *gclist;
   int sizearray;  /* size of `array' array */
+  lu_mem version;  /* renewed whenever a key is added or nodes move */
 } Table;
 
 
@@ -204,11 +204,21 @@ OP_SETLIST,/*	A B C	R(A)[(C-1)*FPF+i] := R(A+i), 1 <= i <= B	*/
 OP_CLOSE,/*	A 	close all variables in the stack up to (>=) R(A)*/
 OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx], R(A), ... ,R(A+n))	*/
 
-OP_VARARG/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
+OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
+
+OP_GLOBALFIELD,/*	A Bx	R(A) := Gbl[Kst(Bx)]; then OP_GETTABLE		*/
+OP_UPVALFIELD,/*	A B	R(A) := UpValue[B]; then OP_GETTABLE		*/
+OP_SELFCALL/*	A B C	R(A+1) := R(B); R(A) := R(B)[RK(C)]; then OP_CALL */
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_VARARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_SELFCALL) + 1)
+
+/* fused opcodes: the base opcode, and the opcode that must follow it */
+#define isfused(o)	((o) >= OP_GLOBALFIELD)
+#define fusedbase(o)	((o) == OP_GLOBALFIELD ? OP_GETGLOBAL : \
+			 (o) == OP_UPVALFIELD ? OP_GETUPVAL : OP_SELF)
+#define fusednext(o)	((o) == OP_SELFCALL ? OP_CALL : OP_GETTABLE)
 
 
 
@@ -230,6 +240,11 @@ OP_VARARG/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
       (true or false).
 
   (*) All `skips' (pc++) assume that next instruction is a jump
+
+  (*) A fused opcode (OP_GLOBALFIELD, OP_UPVALFIELD, OP_SELFCALL) does the
+      work of its base opcode and then runs the next instruction directly,
+      without a dispatch; that instruction is a plain opcode of its own, so
+      jumps may still land on it (see luaK_fuse)
 ===========================================================================*/
 
 
@@ -62,6 +62,8 @@
 
 #define hashpointer(t,p)	hashmod(t, IntPoint(p))
 
+#define hashint(t,i)	hashmod(t, cast(unsigned int, (i)))
+
 
 /*
 ** number of ints inside a lua_Number
@@ -84,8 +86,9 @@ static const Node dummynode_ = {
 static Node *hashnum (const Table *t, lua_Number n) {
   unsigned int a[numints];
   int i;
-  if (luai_numeq(n, 0))  /* avoid problems with -0 */
-    return gnode(t, 0);
+  lua_number2int(i, n);
+  if (luai_numeq(cast_num(i), n))  /* an int (or -0)? hash as luaH_getnum */
+    return hashint(t, i);
   memcpy(a, &n, sizeof(a));
   for (i = 1; i < numints; i++) a[0] += a[i];
   return hashmod(t, a[0]);
@@ -100,7 +103,7 @@ static Node *hashnum (const Table *t, lua_Number n) {
 static Node *mainposition (const Table *t, const TValue *key) {
   switch (ttype(key)) {
     case LUA_TNUMBER:
-      return hashnum(t, nvalue(key));
+      return ttisint(key) ? hashint(t, ivalue(key)) : hashnum(t, nvalue(key));
     case LUA_TSTRING:
       return hashstr(t, rawtsvalue(key));
     case LUA_TBOOLEAN:
@@ -118,7 +121,9 @@ static Node *mainposition (const Table *t, const TValue *key) {
 ** the array part of the table, -1 otherwise.
 */
 static int arrayindex (const TValue *key) {
-  if (ttisnumber(key)) {
+  if (ttisint(key))
+    return ivalue(key);
+  else if (ttisnumber(key)) {
     lua_Number n = nvalue(key);
     int k;
     lua_number2int(k, n);
@@ -163,7 +168,7 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   int i = findindex(L, t, key);  /* find original element */
   for (i++; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
-      setnvalue(key, cast_num(i+1));
+      setivalue(key, i+1);
       setobj2s(L, key+1, &t->array[i]);
       return 1;
     }
@@ -294,11 +299,20 @@ static void setnodevector (lua_State *L, Table *t, int size) {
 }
 
 
+/*
+** a table gets a version never used before whenever a key is added or its
+** nodes move, so a value pointer cached with the version (see GCache in
+** lvm.c) is still right while the version matches
+*/
+#define newversion(L,t)	((t)->version = ++G(L)->tableversion)
+
+
 static void resize (lua_State *L, Table *t, int nasize, int nhsize) {
   int i;
   int oldasize = t->sizearray;
   int oldhsize = t->lsizenode;
   Node *nold = t->node;  /* save old hash ... */
+  newversion(L, t);
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
   /* create new hash part with appropriate size */
@@ -365,6 +379,7 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
   t->sizearray = 0;
   t->lsizenode = 0;
   t->node = cast(Node *, dummynode);
+  newversion(L, t);
   setarrayvector(L, t, narray);
   setnodevector(L, t, nhash);
   return t;
@@ -398,6 +413,7 @@ static Node *getfreepos (Table *t) {
 */
 static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
   Node *mp = mainposition(t, key);
+  newversion(L, t);
   if (!ttisnil(gval(mp)) || mp == dummynode) {
     Node *othern;
     Node *n = getfreepos(t);  /* get a free place */
@@ -423,6 +439,8 @@ static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
     }
   }
   gkey(mp)->value = key->value; gkey(mp)->tt = key->tt;
+  if (ttisnumber(key) && !ttisint(key))  /* integral keys are kept as ints */
+    setnumvalue(key2tval(mp), nvalue(key));
   luaC_barriert(L, t, key);
   lua_assert(ttisnil(gval(mp)));
   return gval(mp);
@@ -434,13 +452,13 @@ static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
 */
 const TValue *luaH_getnum (Table *t, int key) {
   /* (1 <= key && key <= t->sizearray) */
-  if (cast(unsigned int, key-1) < cast(unsigned int, t->sizearray))
+  if (cast(unsigned int, key) - 1 < cast(unsigned int, t->sizearray))
     return &t->array[key-1];
   else {
-    lua_Number nk = cast_num(key);
-    Node *n = hashnum(t, nk);
+    Node *n = hashint(t, key);
     do {  /* check whether `key' is somewhere in the chain */
-      if (ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk))
+      if (ttisint(gkey(n)) ? ivalue(gkey(n)) == key :
+          ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), cast_num(key)))
         return gval(n);  /* that's it */
       else n = gnext(n);
     } while (n);
@@ -463,6 +481,21 @@ const TValue *luaH_getstr (Table *t, TString *key) {
 }
 
 
+/*
+** index in t->node of the node holding string `key', or -1; lets the VM
+** cache where a field lives
+*/
+int luaH_strslot (Table *t, TString *key) {
+  Node *n = hashstr(t, key);
+  do {
+    if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
+      return cast_int(n - t->node);
+    else n = gnext(n);
+  } while (n);
+  return -1;
+}
+
+
 /*
 ** main search function
 */
@@ -472,7 +505,10 @@ const TValue *luaH_get (Table *t, const TValue *key) {
     case LUA_TSTRING: return luaH_getstr(t, rawtsvalue(key));
     case LUA_TNUMBER: {
       int k;
-      lua_Number n = nvalue(key);
+      lua_Number n;
+      if (ttisint(key))
+        return luaH_getnum(t, ivalue(key));
+      n = nvalue(key);
       lua_number2int(k, n);
       if (luai_numeq(cast_num(k), nvalue(key))) /* index is int? */
         return luaH_getnum(t, k);  /* use specialized version */
@@ -511,7 +547,7 @@ TValue *luaH_setnum (lua_State *L, Table *t, int key) {
     return cast(TValue *, p);
   else {
     TValue k;
-    setnvalue(&k, cast_num(key));
+    setivalue(&k, key);
     return newkey(L, t, &k);
   }
 }
@@ -11,17 +11,37 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#if defined(_WIN32)
 #include <winapi/windows.h>
 #include "MemoryModule.h"
 #include <io.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
+#if defined(__ELF__)
+#include <elf.h>
+#endif
+#if defined(__linux__)
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#endif
 #include <sys/stat.h>
 #include <stdint.h>
 
 #define IS_BIG_ENDIAN (*(uint16_t *)"\0\xff" < 0x100)
 
+#ifndef __bswap_constant_32
 #define __bswap_constant_32(x) \
           ((((x) & 0xff000000) >> 24) | (((x) & 0x00ff0000) >>  8) | \
            (((x) & 0x0000ff00) <<  8) | (((x) & 0x000000ff) << 24))
+#endif
 
 #define lua_c
 
@@ -29,6 +49,20 @@
 
 #include "lauxlib.h"
 #include "lualib.h"
+#include "lopcodes.h"
+#include "lundump.h"
+#include "lz4.h"
+#if defined(LUA_COUNT_DISPATCH)
+#include "lvm.h"
+#endif
+
+#if defined(LUA_USE_MMAP)
+#include <sys/mman.h>
+#endif
+
+#if !defined(_WIN32)
+typedef uint8_t BYTE;
+#endif
 
 typedef BYTE SIGNATURE[64];
 
@@ -41,6 +75,15 @@ const SIGNATURE luasig = {0xAB,0x41,0x6C,0x69,0x00,0x00,0x00,0x00,
                           0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
                           0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x01};
 
+/* the last signature byte is the format: 0x01 legacy, 0x02 with an index */
+#define BUNDLEVER	0x02
+
+/* bump when the VM changes the bytecode it accepts without LUAC_FORMAT changing */
+#define PLUA_VMREV	0
+
+/* VM-compatibility stamp in front of the luaU_dump output of 0x20 sections */
+const BYTE bcstamp[8] = {'P','L','B','C',LUAC_VERSION,LUAC_FORMAT,NUM_OPCODES,PLUA_VMREV};
+
 static lua_State *globalL = NULL;
 
 static const char *progname = LUA_PROGNAME;
@@ -48,7 +91,7 @@ static const char *progname = LUA_PROGNAME;
 extern int luaopen_bit(lua_State *L);
 
 typedef struct{
-    unsigned long nofsec;
+    uint32_t nofsec;
     BYTE conf[4];
 } CORE_HEADER;
 
@@ -58,62 +101,839 @@ typedef struct{
 	unsigned int size;
 } SECTION_HEADER;
 
+/*
+** v2 bundles follow the section headers with this index, then
+** uint32 offsets[nofsec+1] (relative to the core header),
+** uint32 hash[hsize] (name index, slots hold section index+1), the
+** optional crc table and uint32 autorun[nauto], so opening one takes
+** constant time
+*/
+typedef struct{
+    uint32_t hsize;
+    uint32_t nauto;  /* XSTALE once SetCharacteristics adds an autorun section */
+    uint32_t flags;
+} CORE_INDEX;
+
+#define XSTALE	0xFFFFFFFFu
+#define XCRC	0x01	/* uint32 crc[nofsec] (CRC32C of the stored bytes) sits before autorun */
+
+/*
+** h:update appends the new body of a section instead of rebuilding the
+** bundle, then a journal of every section replaced so far and a new
+** trailer pointing at it. Opening the bundle applies the journal on top of
+** the index. Once a journal is on disk, the trailer savefile left after the
+** section bodies is pointed at it too; a torn update leaves no trailer at
+** the end, and the bundle then opens with the journal that base trailer
+** names, as it was before that update.
+*/
+typedef struct{
+    BYTE magic[4];
+    uint32_t count;  /* JENTRY records that follow */
+    uint32_t crc;    /* CRC32C of those records */
+} JOURNAL;
+
+typedef struct{
+    uint32_t sec;
+    uint32_t offset;  /* relative to the core header, like offsets[] */
+    uint32_t size;
+    uint32_t crc;
+    uint32_t Characteristics;
+} JENTRY;
+
+const BYTE journalmagic[4] = {'P','L','J','R'};
+
+/*
+** a loaded bundle can be read from any number of lua_States and threads at
+** once: reads are positional or go through the mapping, and the lock only
+** orders writers and the lazily built dl table. Edits (rename,
+** SetCharacteristics, fwrite) are not meant to race with readers
+*/
+#if defined(_WIN32)
+typedef CRITICAL_SECTION CHLOCK;
+#define chlockinit(ch)	InitializeCriticalSection(&(ch)->lock)
+#define chlockfree(ch)	DeleteCriticalSection(&(ch)->lock)
+#define chlock(ch)	EnterCriticalSection(&(ch)->lock)
+#define chunlock(ch)	LeaveCriticalSection(&(ch)->lock)
+#else
+typedef pthread_mutex_t CHLOCK;
+static void chlockinit_(pthread_mutex_t *m){
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init(&a);
+    pthread_mutexattr_settype(&a,PTHREAD_MUTEX_RECURSIVE); /* memdlopen recurses into dependencies */
+    pthread_mutex_init(m,&a);
+    pthread_mutexattr_destroy(&a);
+}
+#define chlockinit(ch)	chlockinit_(&(ch)->lock)
+#define chlockfree(ch)	pthread_mutex_destroy(&(ch)->lock)
+#define chlock(ch)	pthread_mutex_lock(&(ch)->lock)
+#define chunlock(ch)	pthread_mutex_unlock(&(ch)->lock)
+#endif
+
+/* per-section flag bitmaps, set by whichever thread checks the section first */
+#define bitget(m,i)	(__atomic_load_n(&(m)[(i)>>3],__ATOMIC_RELAXED) & (1<<((i)&7)))
+#define bitset(m,i)	__atomic_fetch_or(&(m)[(i)>>3],(BYTE)(1<<((i)&7)),__ATOMIC_RELAXED)
+#define bitclear(m,i)	__atomic_fetch_and(&(m)[(i)>>3],(BYTE)~(1<<((i)&7)),__ATOMIC_RELAXED)
+
+/* decompressed blocks of indexed (ZINDEX) sections kept for random reads, see zread */
+#define ZCACHE	8
+
+typedef struct{
+    unsigned int at;    /* file offset of the block's length word, 0 for a free slot */
+    unsigned int size;
+    unsigned int used;  /* zclock at the last hit */
+    uint8_t *data;
+} ZSLOT;
+
 typedef struct{
 	FILE *f;
 	uint8_t _io;
 	CORE_HEADER chead;
 	unsigned int Coffset;
 	SECTION_HEADER *heads;
-	unsigned int *offsets;
+	unsigned int *offsets;  /* relative to Coffset, see choff */
 	uint8_t *wtype;
+	uint8_t *wflags;
 	unsigned int *pos;
     union{
         char *filename;
         uint8_t *data;
 	} *data;
+	uint8_t *map;
+	size_t mapsize;
+	unsigned int *hidx;
+	unsigned int hsize;
+	void **dl;  /* dlopen handles of loaded dependency sections */
+	BYTE ver;   /* bundle format, the last signature byte */
+	unsigned int xoff;  /* v2: file offset of the CORE_INDEX */
+	unsigned int end;   /* end of the bundle, past any torn update */
+	BYTE *checked;      /* v2: one bit per section whose header was validated */
+	unsigned int *autorun;
+	unsigned int nauto;
+	unsigned int *crc;  /* v2 with XCRC: CRC32C of each section as stored */
+	BYTE *verified;     /* one bit per section whose contents matched crc */
+	JENTRY *journal;    /* v2: sections replaced by h:update, see JOURNAL */
+	unsigned int njournal;
+	unsigned int jat;   /* file offset of the journal on disk */
+	ZSLOT zcache[ZCACHE];  /* least recently used slot goes first; under lock */
+	unsigned int zclock;
+	unsigned int refs;  /* Lua handles, views and require settings using it; see chrelease */
+	CHLOCK lock;
 } CORE_HANDLE;
 
+/* absolute file offset of section i */
+#define choff(ch,i)	((ch)->Coffset+(ch)->offsets[i])
+
 typedef struct{
 	CORE_HANDLE *chandle;
 	unsigned int secnum;
 } SECTION_HANDLE;
 
-CORE_HANDLE *g_ch;
-CORE_HANDLE *C_ch;
+/*
+** optional trailer at the very end of a bundle; lets the runtime find the
+** payload from the end of the file whatever the executable format is
+*/
+typedef struct{
+    uint32_t size;  /* bytes from the signature up to this trailer */
+    uint32_t journal;  /* v2: JOURNAL offset relative to the core header, 0 if none; rewritten in place in the base trailer */
+    BYTE magic[8];
+} TRAILER;
+
+const BYTE trailmagic[8] = {'P','L','U','A','T','R','L',0x01};
+
+CORE_HANDLE *g_ch;  /* bundle of the running executable, never released */
+
+/* map the whole file behind ch->f read-only; ch->map stays NULL on failure */
+static void chmap(CORE_HANDLE *ch){
+    ch->map = NULL;
+    ch->mapsize = 0;
+#if defined(LUA_USE_MMAP)
+    struct stat st;
+    if(fstat(fileno(ch->f),&st) != 0 || st.st_size <= 0) return;
+    void *p = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fileno(ch->f),0);
+    if(p == MAP_FAILED) return;
+    ch->map = p;
+    ch->mapsize = st.st_size;
+#elif defined(_WIN32)
+    long fsize = _filelength(_fileno(ch->f));
+    if(fsize <= 0) return;
+    HANDLE hm = CreateFileMappingA((HANDLE)_get_osfhandle(_fileno(ch->f)),NULL,PAGE_READONLY,0,0,NULL);
+    if(hm == NULL) return;
+    ch->map = MapViewOfFile(hm,FILE_MAP_READ,0,0,0);
+    CloseHandle(hm); /* the view keeps the mapping alive */
+    if(ch->map != NULL) ch->mapsize = fsize;
+#endif
+}
+
+static void chunmap(CORE_HANDLE *ch){
+    if(ch->map == NULL) return;
+#if defined(LUA_USE_MMAP)
+    munmap(ch->map,ch->mapsize);
+#elif defined(_WIN32)
+    UnmapViewOfFile(ch->map);
+#endif
+    ch->map = NULL;
+    ch->mapsize = 0;
+}
+
+/* pointer straight into the mapping, or NULL if the range is not mapped */
+static const uint8_t *chptr(CORE_HANDLE *ch, unsigned int offset, size_t size){
+    if(ch->map == NULL || offset > ch->mapsize || size > ch->mapsize - offset) return NULL;
+    return ch->map + offset;
+}
+
+static long flength(FILE *f){
+#if defined(_WIN32)
+    return _filelength(_fileno(f));
+#else
+    struct stat st;
+    return (fstat(fileno(f),&st) == 0) ? (long)st.st_size : -1;
+#endif
+}
+
+static size_t chread(CORE_HANDLE *ch, void *buf, unsigned int offset, size_t size){
+    if(ch->map != NULL && offset <= ch->mapsize && size <= ch->mapsize - offset){
+        memcpy(buf,ch->map+offset,size);
+        return size;
+    }
+    /* past the mapping only sections appended by h:update; positional, so threads sharing the handle never move a file position */
+#if defined(_WIN32)
+    OVERLAPPED o;
+    DWORD got = 0;
+    memset(&o,0,sizeof(o));
+    o.Offset = offset;
+    return ReadFile((HANDLE)_get_osfhandle(_fileno(ch->f)),buf,size,&got,&o) ? got : 0;
+#else
+    size_t done = 0;
+    while(done < size){
+        ssize_t got = pread(fileno(ch->f),(char *)buf+done,size-done,(off_t)offset+done);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) break;
+        done += got;
+    }
+    return done;
+#endif
+}
+
+static unsigned int chhash(const char *s){
+    unsigned int h = 2166136261u; /* FNV-1a */
+    while(*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+/*
+** CRC32C (Castagnoli), as stored per section in v2 bundles. x86 CPUs with
+** SSE4.2 and ARMv8 builds with the CRC extension compute it in hardware,
+** 8 bytes per instruction; other machines use slicing-by-8 tables
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define CRC_HW	1
+#define crchw_supported()	__builtin_cpu_supports("sse4.2")
+#define CRC_TARGET	__attribute__((target("sse4.2")))
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC_HW	1
+#define crchw_supported()	1
+#define _mm_crc32_u8(c,v)	__crc32cb(c,v)
+#define _mm_crc32_u32(c,v)	__crc32cw(c,v)
+#define _mm_crc32_u64(c,v)	__crc32cd(c,v)
+#endif
+#if defined(CRC_HW)
+#if !defined(CRC_TARGET)
+#define CRC_TARGET
+#endif
+CRC_TARGET static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t size){
+    for(;size > 0 && ((uintptr_t)p & 7) != 0;size--) crc = _mm_crc32_u8(crc,*p++);
+#if defined(__x86_64__) || defined(__aarch64__)
+    uint64_t c = crc;
+    for(;size >= 8;size -= 8,p += 8){
+        uint64_t w;
+        memcpy(&w,p,sizeof(w));
+        c = _mm_crc32_u64(c,w);
+    }
+    crc = (uint32_t)c;
+#else
+    for(;size >= 4;size -= 4,p += 4){
+        uint32_t w;
+        memcpy(&w,p,sizeof(w));
+        crc = _mm_crc32_u32(crc,w);
+    }
+#endif
+    while(size--) crc = _mm_crc32_u8(crc,*p++);
+    return crc;
+}
+#endif
+
+static uint32_t crctab[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t size){
+    if(!IS_BIG_ENDIAN){
+        for(;size > 0 && ((uintptr_t)p & 7) != 0;size--) crc = crctab[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        for(;size >= 8;size -= 8,p += 8){
+            uint32_t lo, hi;
+            memcpy(&lo,p,sizeof(lo));
+            memcpy(&hi,p+4,sizeof(hi));
+            lo ^= crc;
+            crc = crctab[7][lo & 0xFF] ^ crctab[6][(lo >> 8) & 0xFF] ^ crctab[5][(lo >> 16) & 0xFF] ^ crctab[4][lo >> 24]
+                ^ crctab[3][hi & 0xFF] ^ crctab[2][(hi >> 8) & 0xFF] ^ crctab[1][(hi >> 16) & 0xFF] ^ crctab[0][hi >> 24];
+        }
+    }
+    while(size--) crc = crctab[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+typedef uint32_t (*CRCKERNEL)(uint32_t, const uint8_t *, size_t);
+static CRCKERNEL crckernel;
+
+/* build the tables and pick the kernel; the first caller does it, any other waits */
+static CRCKERNEL crcinit(void){
+    static int busy;
+    CRCKERNEL k;
+    if(!__sync_bool_compare_and_swap(&busy,0,1)){
+        while((k = __atomic_load_n(&crckernel,__ATOMIC_ACQUIRE)) == NULL);
+        return k;
+    }
+    for(uint32_t i = 0;i<256;i++){
+        uint32_t c = i;
+        for(int b = 0;b<8;b++) c = (c >> 1) ^ (0x82F63B78u & (0u-(c & 1)));
+        crctab[0][i] = c;
+    }
+    for(uint32_t i = 0;i<256;i++)
+        for(int t = 1;t<8;t++) crctab[t][i] = (crctab[t-1][i] >> 8) ^ crctab[0][crctab[t-1][i] & 0xFF];
+    k = crc32c_sw;
+#if defined(CRC_HW)
+    if(crchw_supported()) k = crc32c_hw;
+#endif
+    __atomic_store_n(&crckernel,k,__ATOMIC_RELEASE);
+    return k;
+}
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t size){
+    CRCKERNEL k = __atomic_load_n(&crckernel,__ATOMIC_ACQUIRE);
+    if(k == NULL) k = crcinit();
+    return ~k(~crc,data,size);
+}
+
+/* does p point into the mapping? such tables are read-only and not freed */
+static int inmap(CORE_HANDLE *ch, const void *p){
+    return ch->map != NULL && (const uint8_t *)p >= ch->map && (const uint8_t *)p <= ch->map+ch->mapsize;
+}
+
+static void chfree(CORE_HANDLE *ch, void *p){
+    if(!inmap(ch,p)) free(p);
+}
+
+/* size bytes of on-disk tables: straight from the mapping when aligned, else a copy */
+static void *chtable(CORE_HANDLE *ch, unsigned int offset, size_t size){
+    const uint8_t *p = chptr(ch,offset,size);
+    void *b;
+    if(p != NULL && ((uintptr_t)p & (sizeof(uint32_t)-1)) == 0) return (void *)p;
+    if((b = malloc(size+1)) != NULL && chread(ch,b,offset,size) != size){
+        free(b);
+        b = NULL;
+    }
+    return b;
+}
+
+/* a private copy of the table p if it lives in the mapping, else p itself; NULL without memory */
+static void *chunshare(CORE_HANDLE *ch, void *p, size_t size){
+    void *b;
+    if(!inmap(ch,p)) return p;
+    if((b = malloc(size+1)) != NULL) memcpy(b,p,size);
+    return b;
+}
+
+/* headers that live in the mapping are copied before they are edited */
+static int chedit(CORE_HANDLE *ch){
+    SECTION_HEADER *h = chunshare(ch,ch->heads,sizeof(SECTION_HEADER)*ch->chead.nofsec);
+    if(h == NULL) return 0;
+    ch->heads = h;
+    return 1;
+}
+
+static unsigned int chhsize(unsigned int n){
+    unsigned int size = 4;
+    while(size < n*2) size <<= 1;
+    return size;
+}
+
+/*
+** fill an open-addressing name index; slots hold section index+1.
+** Sections with the same name share a probe sequence, so the first one
+** found is always the lowest index, as with the old linear scans.
+*/
+static void chhfill(unsigned int *tab, unsigned int size, const SECTION_HEADER *heads, unsigned int n){
+    memset(tab,0,sizeof(unsigned int)*size);
+    for(unsigned int i = 0;i<n;i++){
+        unsigned int h = chhash((const char *)heads[i].name) & (size-1);
+        while(tab[h] != 0) h = (h+1) & (size-1);
+        tab[h] = i+1;
+    }
+}
+
+/* (re)build the name index, keeping the size of a v2 on-disk table */
+static void chindex(CORE_HANDLE *ch){
+    unsigned int size = ch->hsize;
+    chfree(ch,ch->hidx);
+    if(size < ch->chead.nofsec*2 || (size & (size-1)) != 0) size = chhsize(ch->chead.nofsec);
+    ch->hidx = malloc(sizeof(unsigned int)*size);
+    ch->hsize = size;
+    if(ch->hidx != NULL) chhfill(ch->hidx,size,ch->heads,ch->chead.nofsec);
+}
+
+int checkString( const char s[] );
+
+/*
+** v2 headers are checked on first use instead of at open time: the name
+** must be terminated and printable, the contents must lie inside the file
+*/
+static int chsec(CORE_HANDLE *ch, unsigned int i){
+    const SECTION_HEADER *sh;
+    if(i >= ch->chead.nofsec) return 0;
+    if(ch->checked == NULL || bitget(ch->checked,i)) return 1;
+    sh = &ch->heads[i];
+    if(memchr(sh->name,0,sizeof(sh->name)) == NULL || !checkString((const char *)sh->name)) return 0;
+    if(ch->offsets[i] > ch->end-ch->Coffset || sh->size > ch->end-choff(ch,i)) return 0;
+    bitset(ch->checked,i);
+    return 1;
+}
+
+/* first section called name whose Characteristics share a bit with mask
+   (any section when mask is 0); -1 if there is none */
+static int chfind(CORE_HANDLE *ch, const char *name, BYTE mask){
+    if(ch->hidx == NULL) return -1;
+    unsigned int h = chhash(name) & (ch->hsize-1);
+    unsigned int s;
+    for(unsigned int k = 0;k<ch->hsize && (s = ch->hidx[h]) != 0;k++){
+        if(chsec(ch,s-1)){
+            SECTION_HEADER *sh = &ch->heads[s-1];
+            if(strcmp((const char *)sh->name,name) == 0 && (mask == 0 || (sh->Characteristics & mask)))
+                return s-1;
+        }
+        h = (h+1) & (ch->hsize-1);
+    }
+    return -1;
+}
+
+#define ZBLOCK	65536	/* raw bytes per LZ4 block written by fplua_save */
+
+/*
+** prefix of a compressed (0x40) section, followed by [u32 length][block]...
+** With ZINDEX, uint32 boff[blocks] sits in between: the offset of each
+** length word from the start of the section, for random access
+*/
+typedef struct{
+    uint32_t rawsize;
+    uint32_t blocksize;
+} ZHEADER;
+
+#define ZSTORED	0x80000000u	/* block length flag: kept uncompressed */
+#define ZINDEX	0x40000000u	/* blocksize flag: the block offset table follows */
+#define zblocks(zh)	((unsigned int)(((uint64_t)(zh)->rawsize+((zh)->blocksize & ~ZINDEX)-1)/((zh)->blocksize & ~ZINDEX)))
+
+/* CRC32C of the bytes section i has in the file */
+static int chsum(CORE_HANDLE *ch, unsigned int i, uint32_t *crc){
+    unsigned int off = choff(ch,i), left = ch->heads[i].size;
+    const uint8_t *p = chptr(ch,off,left);
+    uint8_t *buf;
+    *crc = 0;
+    if(p != NULL){
+        *crc = crc32c(0,p,left);
+        return 1;
+    }
+    if((buf = malloc(ZBLOCK)) == NULL) return 0;
+    while(left > 0){
+        size_t k = chread(ch,buf,off,(left < ZBLOCK) ? left : ZBLOCK);
+        if(k == 0) break;
+        *crc = crc32c(*crc,buf,k);
+        off += k;
+        left -= k;
+    }
+    free(buf);
+    return left == 0;
+}
+
+/*
+** does section i still hold what was saved? Checked against its CRC32C the
+** first time the contents are used; bundles without checksums always pass
+*/
+static int chverify(CORE_HANDLE *ch, unsigned int i){
+    uint32_t crc;
+    if(!chsec(ch,i)) return 0;
+    if(ch->crc == NULL || bitget(ch->verified,i)) return 1;
+    if(!chsum(ch,i,&crc) || crc != ch->crc[i]) return 0;
+    bitset(ch->verified,i);
+    return 1;
+}
+
+/* does a trailer end at file offset end of the bundle whose signature is at start? */
+static int chtrailer(CORE_HANDLE *ch, unsigned int end, long start, TRAILER *t){
+    return end >= sizeof(TRAILER) && chread(ch,t,end-sizeof(TRAILER),sizeof(TRAILER)) == sizeof(TRAILER)
+        && memcmp(t->magic,trailmagic,sizeof(trailmagic)) == 0
+        && t->size == end-sizeof(TRAILER)-(unsigned long)start;
+}
+
+/*
+** write the journal jl at file offset at and the trailer pointing at it,
+** then point the base trailer at it as well; the caller holds the lock
+*/
+static int chjwrite(CORE_HANDLE *ch, unsigned int at, const JENTRY *jl, unsigned int cnt){
+    JOURNAL j;
+    TRAILER t, b;
+    unsigned int base = choff(ch,ch->chead.nofsec);
+    memcpy(j.magic,journalmagic,sizeof(journalmagic));
+    j.count = cnt;
+    j.crc = crc32c(0,jl,sizeof(JENTRY)*cnt);
+    t.size = at+sizeof(j)+sizeof(JENTRY)*cnt-(ch->Coffset-sizeof(SIGNATURE));
+    t.journal = at-ch->Coffset;
+    memcpy(t.magic,trailmagic,sizeof(trailmagic));
+    fseek(ch->f,at,SEEK_SET);
+    if(fwrite(&j,sizeof(j),1,ch->f) != 1 || fwrite(jl,sizeof(JENTRY),cnt,ch->f) != cnt
+       || fwrite(&t,sizeof(t),1,ch->f) != 1 || fflush(ch->f) != 0) return 0;
+    if(!chtrailer(ch,base+sizeof(TRAILER),ch->Coffset-sizeof(SIGNATURE),&b)) return 1;  /* saved without one */
+    fseek(ch->f,base+offsetof(TRAILER,journal),SEEK_SET);
+    return fwrite(&t.journal,sizeof(t.journal),1,ch->f) == 1 && fflush(ch->f) == 0;
+}
+
+/*
+** in-place edits of a replaced section go to its journal entry rather than
+** the index, which still describes the original body. Returns 0 if section
+** i was never replaced.
+*/
+static int chjsync(CORE_HANDLE *ch, unsigned int i){
+    for(unsigned int k = 0;k<ch->njournal;k++){
+        if(ch->journal[k].sec != i) continue;
+        ch->journal[k].crc = (ch->crc != NULL) ? ch->crc[i] : 0;
+        ch->journal[k].Characteristics = ch->heads[i].Characteristics;
+        chjwrite(ch,ch->jat,ch->journal,ch->njournal);
+        return 1;
+    }
+    return 0;
+}
+
+/* point section e->sec at its replacement; 0 if the entry lies outside the file */
+static int chapply(CORE_HANDLE *ch, const JENTRY *e){
+    unsigned int room = ch->end-ch->Coffset;
+    if(e->sec >= ch->chead.nofsec || e->offset > room || e->size > room-e->offset) return 0;
+    ch->offsets[e->sec] = e->offset;
+    ch->heads[e->sec].size = e->size;
+    ch->heads[e->sec].Characteristics = (BYTE)e->Characteristics;
+    if(ch->crc != NULL) ch->crc[e->sec] = e->crc;
+    if(ch->verified != NULL) bitclear(ch->verified,e->sec);
+    return 1;
+}
+
+/* store a new checksum for section i, and the sections sharing its bytes, after an in-place write */
+static void chrecrc(CORE_HANDLE *ch, unsigned int i){
+    unsigned int n = ch->chead.nofsec, at;
+    uint32_t crc;
+    unsigned int *c;
+    if(ch->crc == NULL || !chsum(ch,i,&crc) || (c = chunshare(ch,ch->crc,sizeof(uint32_t)*n)) == NULL) return;
+    ch->crc = c;
+    at = ch->xoff+sizeof(CORE_INDEX)+sizeof(uint32_t)*(n+1+ch->hsize);
+    chlock(ch);
+    for(unsigned int k = 0;k<n;k++){
+        if(ch->offsets[k] != ch->offsets[i] || ch->heads[k].size != ch->heads[i].size) continue;
+        ch->crc[k] = crc;
+        bitset(ch->verified,k);
+        if(chjsync(ch,k)) continue;
+        fseek(ch->f,at+sizeof(uint32_t)*k,SEEK_SET);
+        fwrite(&crc,sizeof(crc),1,ch->f);
+    }
+    fflush(ch->f);
+    chunlock(ch);
+}
 
 typedef struct
 {
- FILE *f;
- size_t size;
+ CORE_HANDLE *ch;
+ unsigned int offset;  /* next stored byte */
+ unsigned int end;     /* end of the stored bytes */
+ int z;                /* stored as LZ4 blocks? */
+ int err;              /* malformed compressed data */
+ unsigned int rawleft; /* bytes still to be decoded */
+ unsigned int blocksize;
+ const char *p;        /* bytes not handed out yet */
+ size_t n;
+ char *out;            /* decoded block */
+ char *in;             /* stored block when the payload is not mapped */
  char buff[512];
 } State;
 
+static void sopen(State *S, CORE_HANDLE *ch, unsigned int offset, unsigned int size, int z)
+{
+ S->ch=ch;
+ S->offset=offset;
+ S->end=offset+size;
+ S->z=z;
+ S->err=0;
+ S->n=0;
+ S->out=S->in=NULL;
+ if (z) {
+  ZHEADER zh;
+  if (size<sizeof(zh) || chread(ch,&zh,offset,sizeof(zh))!=sizeof(zh)
+      || (zh.blocksize & ~ZINDEX)==0 || (zh.blocksize & ~ZINDEX)>ZSTORED/2
+      || ((zh.blocksize & ZINDEX) && zblocks(&zh)>(size-sizeof(zh))/sizeof(uint32_t))) {
+   S->err=1;
+   S->rawleft=0;
+   return;
+  }
+  S->offset+=sizeof(zh);
+  if (zh.blocksize & ZINDEX) S->offset+=sizeof(uint32_t)*zblocks(&zh);  /* read in order anyway */
+  S->rawleft=zh.rawsize;
+  S->blocksize=zh.blocksize & ~ZINDEX;
+ }
+}
+
+static void sclose(State *S)
+{
+ free(S->out);
+ free(S->in);
+ S->out=S->in=NULL;
+}
+
+/* make sure some bytes are pending in S->p; returns how many (0 at the end) */
+static size_t sfill(State *S)
+{
+ const char *src;
+ uint32_t clen;
+ unsigned int len, raw;
+ if (S->n>0 || S->err) return S->n;
+ if (!S->z) {
+  if (S->offset>=S->end) return 0;
+  S->p=(const char *)chptr(S->ch,S->offset,S->end-S->offset);
+  if (S->p!=NULL) S->n=S->end-S->offset;  /* mapped: the whole rest at once */
+  else {
+   S->n=S->end-S->offset;
+   if (S->n>sizeof(S->buff)) S->n=sizeof(S->buff);
+   S->n=chread(S->ch,S->buff,S->offset,S->n);
+   S->p=S->buff;
+  }
+  S->offset+=S->n;
+  return S->n;
+ }
+ if (S->rawleft==0) return 0;
+ raw=(S->rawleft<S->blocksize) ? S->rawleft : S->blocksize;
+ if (S->end-S->offset<sizeof(clen) || chread(S->ch,&clen,S->offset,sizeof(clen))!=sizeof(clen))
+  goto corrupt;
+ S->offset+=sizeof(clen);
+ len=clen & ~ZSTORED;
+ if (len>S->end-S->offset || len>(unsigned int)LZ4_COMPRESSBOUND(S->blocksize)) goto corrupt;
+ src=(const char *)chptr(S->ch,S->offset,len);
+ if (src==NULL) {
+  if (S->in==NULL && (S->in=malloc(LZ4_COMPRESSBOUND(S->blocksize)))==NULL) goto corrupt;
+  if (chread(S->ch,S->in,S->offset,len)!=len) goto corrupt;
+  src=S->in;
+ }
+ S->offset+=len;
+ if (clen & ZSTORED) {
+  if (len!=raw) goto corrupt;
+  S->p=src;
+ }
+ else {
+  if (S->out==NULL && (S->out=malloc(S->blocksize))==NULL) goto corrupt;
+  if (LZ4_decompress_safe(src,S->out,len,raw)!=(int)raw) goto corrupt;
+  S->p=S->out;
+ }
+ S->rawleft-=raw;
+ S->n=raw;
+ return raw;
+corrupt:
+ S->err=1;
+ S->n=0;
+ return 0;
+}
+
+static size_t sread(State *S, void *buf, size_t size)
+{
+ size_t done=0;
+ while (done<size && sfill(S)>0) {
+  size_t k=(S->n<size-done) ? S->n : size-done;
+  memcpy((char *)buf+done,S->p,k);
+  S->p+=k;
+  S->n-=k;
+  done+=k;
+ }
+ return done;
+}
+
+static void sskip(State *S, size_t size)
+{
+ while (size>0 && sfill(S)>0) {
+  size_t k=(S->n<size) ? S->n : size;
+  S->p+=k;
+  S->n-=k;
+  size-=k;
+ }
+}
+
 static const char *myget(lua_State *L, void *data, size_t *size)
 {
  State* s=data;
- size_t n;
  (void)L;
- n=(sizeof(s->buff)<=s->size)? sizeof(s->buff) : s->size;
- n=fread(s->buff,1,n,s->f);
- s->size-=n;
- *size=n;
- return (n>0) ? s->buff : NULL;
+ *size=sfill(s);
+ s->n=0;
+ return (*size>0) ? s->p : NULL;
 }
 
-#define cannot(x) luaL_error(L,"cannot %s %s: %s",x,name,strerror(errno))
+static void load(lua_State *L,State *S, const char *name)
+{
+ int status;
+ if (sfill(S)>0 && *S->p=='#')  /* skip a #! line, keeping its newline */
+  while (sfill(S)>0 && *S->p!='\n') { S->p++; S->n--; }
+ status=lua_load(L,myget,S,"=");
+ if (S->err) {
+  sclose(S);
+  luaL_error(L,"cannot load %s: section data is corrupted",name);
+ }
+ sclose(S);
+ if (status!=0) lua_error(L);
+}
+
+#define CACHEKEY	64
+
+static int cacheload(lua_State *L, CORE_HANDLE *ch, unsigned int i, char *key);
+static void cachestore(lua_State *L, const char *key);
 
-static void load(lua_State *L,FILE *f, const char *name, unsigned int offset, unsigned int size)
+/*
+** load section i, going straight to luaU_undump for precompiled (0x20) ones;
+** source sections go through the bytecode cache when one is set
+*/
+static void loadsection(lua_State *L,CORE_HANDLE *ch,unsigned int i)
 {
+ const char *name=(const char *)ch->heads[i].name;
+ char key[CACHEKEY];
  State S;
- int c;
- if (fseek(f,offset,SEEK_SET)!=0) cannot("seek");
- S.f=f; S.size=size;
- c=getc(f);
- if (c=='#')
-  while (--S.size>0 && c!='\n') c=getc(f);
- else
-  ungetc(c,f);
- if (lua_load(L,myget,&S,"=")!=0) lua_error(L);
+ if (!chverify(ch,i)) luaL_error(L,"cannot load %s: section data is corrupted",name);
+ key[0]='\0';
+ if (!(ch->heads[i].Characteristics & 0x20) && cacheload(L,ch,i,key)) return;
+ sopen(&S,ch,choff(ch,i),ch->heads[i].size,ch->heads[i].Characteristics & 0x40);
+ if (ch->heads[i].Characteristics & 0x20) {
+  BYTE stamp[sizeof(bcstamp)];
+  if (sread(&S,stamp,sizeof(bcstamp))!=sizeof(bcstamp) || memcmp(stamp,bcstamp,sizeof(bcstamp))!=0) {
+   sclose(&S);
+   luaL_error(L,"section %s holds bytecode for an incompatible VM",name);
+  }
+ }
+ load(L,&S,name);
+ if (key[0]!='\0') cachestore(L,key);
+}
+
+/*
+** decompressed block whose length word is at file offset at, holding raw
+** bytes; from the handle's cache or decoded into its least recently used
+** slot. The caller holds the lock; NULL for a corrupted block.
+*/
+static const uint8_t *zblock(CORE_HANDLE *ch, unsigned int at, unsigned int raw, unsigned int len)
+{
+ ZSLOT *z=&ch->zcache[0];
+ const char *src;
+ char *in=NULL;
+ ch->zclock++;
+ for (unsigned int k=0; k<ZCACHE; k++) {
+  if (ch->zcache[k].at==at && ch->zcache[k].data!=NULL) {
+   ch->zcache[k].used=ch->zclock;
+   return ch->zcache[k].data;
+  }
+  if (ch->zcache[k].used<z->used) z=&ch->zcache[k];
+ }
+ if ((src=(const char *)chptr(ch,at+sizeof(uint32_t),len))==NULL) {
+  if ((in=malloc(len+1))==NULL || chread(ch,in,at+sizeof(uint32_t),len)!=len) {
+   free(in);
+   return NULL;
+  }
+  src=in;
+ }
+ if (z->data==NULL || z->size<raw) {
+  free(z->data);
+  z->at=0;
+  if ((z->data=malloc(raw+1))==NULL) {
+   free(in);
+   return NULL;
+  }
+  z->size=raw;
+ }
+ if (LZ4_decompress_safe(src,(char *)z->data,len,raw)!=(int)raw) {
+  free(in);
+  z->at=0;
+  return NULL;
+ }
+ free(in);
+ z->at=at;
+ z->used=ch->zclock;
+ return z->data;
+}
+
+/*
+** copy *size raw bytes from position pos of the indexed compressed section
+** i into dst, decoding only the blocks they touch; *size is cut down to
+** what exists. Returns 0 for corrupted data.
+*/
+static int zread(CORE_HANDLE *ch, unsigned int i, const ZHEADER *zh, unsigned int pos, uint8_t *dst, size_t *size)
+{
+ unsigned int bs=zh->blocksize & ~ZINDEX, sec=choff(ch,i), ssize=ch->heads[i].size;
+ size_t done=0;
+ if (ssize<sizeof(*zh) || bs==0 || bs>ZSTORED/2 || zblocks(zh)>(ssize-sizeof(*zh))/sizeof(uint32_t)) return 0;
+ if (pos>=zh->rawsize) *size=0;
+ else if (*size>zh->rawsize-pos) *size=zh->rawsize-pos;
+ while (done<*size) {
+  unsigned int b=(pos+done)/bs, in=(pos+done)%bs;
+  unsigned int raw=(zh->rawsize-b*bs<bs) ? zh->rawsize-b*bs : bs;
+  size_t k=(raw-in<*size-done) ? raw-in : *size-done;
+  uint32_t boff, clen;
+  unsigned int len;
+  if (chread(ch,&boff,sec+sizeof(*zh)+sizeof(uint32_t)*b,sizeof(boff))!=sizeof(boff)
+      || boff>ssize-sizeof(clen) || chread(ch,&clen,sec+boff,sizeof(clen))!=sizeof(clen)) return 0;
+  len=clen & ~ZSTORED;
+  if (len>ssize-boff-sizeof(clen) || len>(unsigned int)LZ4_COMPRESSBOUND(bs)) return 0;
+  if (clen & ZSTORED) {
+   if (len!=raw || chread(ch,dst+done,sec+boff+sizeof(clen)+in,k)!=k) return 0;
+  }
+  else {
+   const uint8_t *p;
+   chlock(ch);
+   p=zblock(ch,sec+boff,raw,len);
+   if (p!=NULL) memcpy(dst+done,p+in,k);
+   chunlock(ch);
+   if (p==NULL) return 0;
+  }
+  done+=k;
+ }
+ return 1;
+}
+
+/*
+** whole contents of section i, decompressed; points into the mapping when
+** possible, otherwise *copy is set to a buffer the caller must free
+*/
+static const uint8_t *secdata(CORE_HANDLE *ch, unsigned int i, size_t *size, uint8_t **copy)
+{
+ const uint8_t *p;
+ *copy=NULL;
+ if (!chverify(ch,i)) return NULL;
+ if (!(ch->heads[i].Characteristics & 0x40)) {
+  *size=ch->heads[i].size;
+  p=chptr(ch,choff(ch,i),*size);
+  if (p!=NULL) return p;
+  if ((*copy=malloc(*size+1))==NULL) return NULL;
+  *size=chread(ch,*copy,choff(ch,i),*size);
+  return *copy;
+ }
+ else {
+  State S;
+  ZHEADER zh;
+  if (chread(ch,&zh,choff(ch,i),sizeof(zh))!=sizeof(zh)) return NULL;
+  if ((*copy=malloc(zh.rawsize+1))==NULL) return NULL;
+  sopen(&S,ch,choff(ch,i),ch->heads[i].size,1);
+  *size=sread(&S,*copy,zh.rawsize);
+  sclose(&S);
+  if (S.err || *size!=zh.rawsize) {
+   free(*copy);
+   *copy=NULL;
+   return NULL;
+  }
+  return *copy;
+ }
 }
 
 
@@ -428,6 +1248,7 @@ struct Smain {
   int status;
 };
 
+#if defined(_WIN32)
 int sizeofpe(FILE *f){
     int pos = ftell(f);
     uint32_t pointdata = 0;
@@ -450,6 +1271,56 @@ int sizeofpe(FILE *f){
     return pointdata+sizepd;
 }
 
+#endif
+
+#if defined(__ELF__)
+#define ELFEND(e,p) ((uint64_t)(e)->p##off + (uint64_t)(e)->p##num*(e)->p##entsize)
+
+/* end of the ELF image: the furthest header table, segment or section */
+#define ELFSIZE(Ehdr,Phdr,Shdr) { \
+    Ehdr eh; \
+    uint64_t end; \
+    if(fread(&eh,sizeof(eh),1,f) != 1) return -1; \
+    end = ELFEND(&eh,e_ph) > ELFEND(&eh,e_sh) ? ELFEND(&eh,e_ph) : ELFEND(&eh,e_sh); \
+    for(unsigned int i = 0;i<eh.e_phnum;i++){ \
+        Phdr ph; \
+        if(fseek(f,eh.e_phoff+(uint64_t)i*eh.e_phentsize,SEEK_SET) != 0 || fread(&ph,sizeof(ph),1,f) != 1) return -1; \
+        if(ph.p_offset+ph.p_filesz > end) end = ph.p_offset+ph.p_filesz; \
+    } \
+    for(unsigned int i = 0;i<eh.e_shnum;i++){ \
+        Shdr sh; \
+        if(fseek(f,eh.e_shoff+(uint64_t)i*eh.e_shentsize,SEEK_SET) != 0 || fread(&sh,sizeof(sh),1,f) != 1) return -1; \
+        if(sh.sh_type != SHT_NOBITS && sh.sh_offset+sh.sh_size > end) end = sh.sh_offset+sh.sh_size; \
+    } \
+    return (long)end; \
+}
+
+static long elfsize(FILE *f){
+    unsigned char ident[EI_NIDENT];
+    rewind(f);
+    if(fread(ident,EI_NIDENT,1,f) != 1 || memcmp(ident,ELFMAG,SELFMAG) != 0) return -1;
+    if(ident[EI_DATA] != (IS_BIG_ENDIAN ? ELFDATA2MSB : ELFDATA2LSB)) return -1;
+    rewind(f);
+    if(ident[EI_CLASS] == ELFCLASS64) ELFSIZE(Elf64_Ehdr,Elf64_Phdr,Elf64_Shdr)
+    if(ident[EI_CLASS] == ELFCLASS32) ELFSIZE(Elf32_Ehdr,Elf32_Phdr,Elf32_Shdr)
+    return -1;
+}
+#endif
+
+/* size of the running executable image, i.e. where appended data starts */
+int sizeofimage(FILE *f){
+    long size = -1;
+    long pos = ftell(f);
+#if defined(_WIN32)
+    size = sizeofpe(f);
+#elif defined(__ELF__)
+    size = elfsize(f);
+#endif
+    if(size < 0) size = flength(f);  /* unknown format: only a trailer can help */
+    fseek(f,pos,SEEK_SET);
+    return size;
+}
+
 int pesize;
 int filesize;
 char* getprog(void) {
@@ -457,14 +1328,282 @@ char* getprog(void) {
   char* progdir = malloc(nsize * sizeof(char));
   char *lb;
   int n;
+#if defined(_WIN32)
   n = GetModuleFileNameA(NULL, progdir, nsize);
-  if (n == 0 || n == nsize || (lb = strrchr(progdir, (int)LUA_DIRSEP[0])) == NULL)
+#else
+  n = readlink("/proc/self/exe", progdir, nsize);
+  if (n < 0 && progname != NULL && strlen(progname) < (size_t)nsize)
+    n = strlen(strcpy(progdir, progname));  /* no procfs: trust argv[0] */
+  if (n > 0 && n < nsize) progdir[n] = '\0';
+#endif
+  if (n <= 0 || n == nsize || (lb = strrchr(progdir, (int)LUA_DIRSEP[0])) == NULL) {
+    free(progdir);
     return(NULL);
+  }
   return(progdir);
 }
 
+/* format version of the bundle whose signature is at offset, 0 if there is none */
+static int checksig(CORE_HANDLE *ch, long offset){
+    SIGNATURE sig;
+    if(offset < 0 || chread(ch,sig,offset,sizeof(SIGNATURE)) != sizeof(SIGNATURE)
+       || memcmp(&luasig,&sig,sizeof(SIGNATURE)-1) != 0) return 0;
+    return (sig[sizeof(SIGNATURE)-1] >= 0x01 && sig[sizeof(SIGNATURE)-1] <= BUNDLEVER) ? sig[sizeof(SIGNATURE)-1] : 0;
+}
+
+/*
+** locate the bundle after an image of imagesize bytes: a trailer at the end
+** of the file wins, otherwise the signature must follow the image directly.
+** Returns the offset of the signature, or -1 if there is no bundle.
+*/
+static long findbundle(CORE_HANDLE *ch, long imagesize, long filesize){
+    TRAILER t;
+    if(filesize >= (long)(sizeof(TRAILER)+sizeof(SIGNATURE))
+       && chread(ch,&t,filesize-sizeof(TRAILER),sizeof(TRAILER)) == sizeof(TRAILER)
+       && memcmp(t.magic,trailmagic,sizeof(trailmagic)) == 0
+       && t.size <= filesize-sizeof(TRAILER)){
+        long start = filesize-sizeof(TRAILER)-t.size;
+        if(checksig(ch,start)) return start;
+    }
+    return checksig(ch,imagesize) ? imagesize : -1;
+}
+
+/* legacy bundles carry no offsets: sum the sizes and check every header now */
+static int chlegacy(CORE_HANDLE *ch){
+    unsigned int n = ch->chead.nofsec;
+    unsigned int currpos = sizeof(CORE_HEADER)+sizeof(SECTION_HEADER)*n;
+    if(!chedit(ch) || (ch->offsets = malloc(sizeof(unsigned int)*(n+1))) == NULL) return 0;
+    for(unsigned int i = 0; i < n; i++){
+        ch->heads[i].name[58] = '\0';
+        if(!checkString((const char *)ch->heads[i].name)) return 0;
+        if(((ch->heads[i].Characteristics & 0x10) == 0x10)&&(i != 0)){
+            ch->offsets[i] = ch->offsets[i-1];
+            ch->heads[i].size = ch->heads[i-1].size;
+            ch->heads[i].Characteristics = ch->heads[i-1].Characteristics;
+        }else{
+            ch->offsets[i] = currpos;
+            currpos += ch->heads[i].size;
+        }
+    }
+    ch->offsets[n] = currpos;
+    chindex(ch);
+    return ch->hidx != NULL;
+}
+
+/*
+** apply the journal of the bundle whose signature is at start. It is named
+** by the trailer at the end of the file or, when a torn update left none
+** there, by the base trailer after the section bodies, and ch->end moves
+** back to the trailer that follows it. Returns 0 for a damaged journal.
+*/
+static int chjournal(CORE_HANDLE *ch, long start){
+    TRAILER t;
+    JOURNAL j;
+    unsigned int n = ch->chead.nofsec, flen = ch->end;
+    uint64_t base = (uint64_t)choff(ch,n)+sizeof(TRAILER);
+    if(!chtrailer(ch,flen,start,&t)){
+        if(base > flen || !chtrailer(ch,(unsigned int)base,start,&t)) return 1;
+        ch->end = (unsigned int)base;  /* the next update overwrites the torn tail */
+    }
+    if(t.journal == 0) return 1;
+    ch->jat = ch->Coffset+t.journal;
+    if((uint64_t)ch->Coffset+t.journal+sizeof(JOURNAL)+sizeof(TRAILER) > flen
+       || chread(ch,&j,ch->jat,sizeof(j)) != sizeof(j)
+       || memcmp(j.magic,journalmagic,sizeof(journalmagic)) != 0
+       || j.count > (flen-sizeof(TRAILER)-sizeof(JOURNAL)-ch->jat)/sizeof(JENTRY)) return 0;
+    ch->end = ch->jat+sizeof(j)+sizeof(JENTRY)*j.count+sizeof(TRAILER);
+    if(!chtrailer(ch,ch->end,start,&t) || ch->Coffset+t.journal != ch->jat) return 0;
+    if((ch->journal = malloc(sizeof(JENTRY)*j.count+1)) == NULL
+       || chread(ch,ch->journal,ch->jat+sizeof(j),sizeof(JENTRY)*j.count) != sizeof(JENTRY)*j.count
+       || crc32c(0,ch->journal,sizeof(JENTRY)*j.count) != j.crc) return 0;
+    ch->njournal = j.count;
+    if(!chedit(ch) || (ch->offsets = chunshare(ch,ch->offsets,sizeof(uint32_t)*(n+1))) == NULL
+       || (ch->crc != NULL && (ch->crc = chunshare(ch,ch->crc,sizeof(uint32_t)*n)) == NULL)) return 0;
+    for(unsigned int k = 0;k<j.count;k++)
+        if(!chapply(ch,&ch->journal[k])) return 0;
+    return 1;
+}
+
+/*
+** read the bundle whose signature is at start into a zeroed handle.
+** v2 tables are used in place, and their headers are only checked by chsec
+** when a section is first touched. Returns 0 for a malformed bundle; the
+** caller then releases the handle with chclose.
+*/
+static int chparse(CORE_HANDLE *ch, long start){
+    CORE_INDEX x;
+    unsigned int n, at;
+    long flen = (ch->map != NULL) ? (long)ch->mapsize : flength(ch->f);
+    ch->_io = 0;
+    ch->ver = checksig(ch,start);
+    ch->Coffset = start+sizeof(SIGNATURE);
+    if(ch->ver == 0 || flen < (long)(ch->Coffset+sizeof(CORE_HEADER))) return 0;
+    ch->end = flen;
+    if(chread(ch,&ch->chead,ch->Coffset,sizeof(CORE_HEADER)) != sizeof(CORE_HEADER)) return 0;
+    n = ch->chead.nofsec;
+    at = ch->Coffset+sizeof(CORE_HEADER);
+    if(n > (ch->end-at)/sizeof(SECTION_HEADER)) return 0;
+    if((ch->pos = calloc(n+1,sizeof(unsigned int))) == NULL) return 0;
+    if((ch->heads = chtable(ch,at,sizeof(SECTION_HEADER)*n)) == NULL) return 0;
+    at += sizeof(SECTION_HEADER)*n;
+    if(ch->ver == 0x01) return chlegacy(ch);
+    ch->xoff = at;
+    if(chread(ch,&x,at,sizeof(x)) != sizeof(x)) return 0;
+    at += sizeof(x);
+    if(x.hsize < n*2 || (x.hsize & (x.hsize-1)) != 0 || x.hsize > (ch->end-at)/sizeof(uint32_t)
+       || (x.nauto > n && x.nauto != XSTALE)) return 0;
+    if((ch->offsets = chtable(ch,at,sizeof(uint32_t)*(n+1))) == NULL) return 0;
+    at += sizeof(uint32_t)*(n+1);
+    if((ch->hidx = chtable(ch,at,sizeof(uint32_t)*x.hsize)) == NULL) return 0;
+    ch->hsize = x.hsize;
+    at += sizeof(uint32_t)*x.hsize;
+    if(x.flags & XCRC){
+        if((ch->crc = chtable(ch,at,sizeof(uint32_t)*n)) == NULL || (ch->verified = calloc(n/8+1,1)) == NULL) return 0;
+        at += sizeof(uint32_t)*n;
+    }
+    ch->nauto = x.nauto;
+    if(x.nauto != XSTALE && (ch->autorun = chtable(ch,at,sizeof(uint32_t)*x.nauto)) == NULL) return 0;
+    return (ch->checked = calloc(n/8+1,1)) != NULL && chjournal(ch,start);
+}
+
+static void chclose(CORE_HANDLE *ch){
+    chfree(ch,ch->heads);
+    chfree(ch,ch->offsets);
+    chfree(ch,ch->hidx);
+    chfree(ch,ch->autorun);
+    chfree(ch,ch->crc);
+    free(ch->checked);
+    free(ch->verified);
+    free(ch->journal);
+    for(unsigned int k = 0;k<ZCACHE;k++) free(ch->zcache[k].data);
+    free(ch->pos);
+    free(ch->dl);  /* the objects themselves stay loaded */
+    chunmap(ch);
+    if(ch->f != NULL) fclose(ch->f);
+    chlockfree(ch);
+    free(ch);
+}
+
+/* zeroed handle for the bundle file f, mapped and holding one reference */
+static CORE_HANDLE *chnew(FILE *f){
+    CORE_HANDLE *ch = calloc(1,sizeof(CORE_HANDLE));
+    if(ch == NULL) return NULL;
+    ch->f = f;
+    ch->refs = 1;
+    chlockinit(ch);
+    chmap(ch);
+    return ch;
+}
+
+static void chretain(CORE_HANDLE *ch){
+    __sync_fetch_and_add(&ch->refs,1);
+}
+
+/* drop a reference; the last one closes the file and the mapping */
+static void chrelease(CORE_HANDLE *ch){
+    if(__sync_sub_and_fetch(&ch->refs,1) == 0) chclose(ch);
+}
+
+/*
+** startup readahead: the OS is asked to start reading the autorun sections
+** before the first one is loaded, and a background thread does the same
+** for the module sections so a later require finds them in the page cache
+*/
+#define WARMGAP	65536	/* ranges closer than this are hinted as one */
+
+#if defined(_WIN32)
+typedef struct{
+    ULONG_PTR addr;
+    SIZE_T size;
+} PFRANGE;
+typedef BOOL (WINAPI *PFVM)(HANDLE, ULONG_PTR, PFRANGE *, DWORD);
+static PFVM prefetchvm; /* PrefetchVirtualMemory, Windows 8 and later */
+#endif
+
+static void warmrange(CORE_HANDLE *ch, unsigned int off, unsigned int len){
+    if(len == 0) return;
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fileno(ch->f),off,len,POSIX_FADV_WILLNEED);
+#elif defined(LUA_USE_MMAP) && defined(MADV_WILLNEED)
+    if(chptr(ch,off,len) != NULL){
+        uintptr_t page = sysconf(_SC_PAGESIZE), a = (uintptr_t)ch->map+off;
+        madvise((void *)(a & ~(page-1)),len+(a & (page-1)),MADV_WILLNEED);
+    }
+#elif defined(_WIN32)
+    if(prefetchvm != NULL && chptr(ch,off,len) != NULL){
+        PFRANGE r = {(ULONG_PTR)ch->map+off,len};
+        prefetchvm(GetCurrentProcess(),1,&r,0);
+    }
+#endif
+}
+
+/* hint section i, merging it with the pending range [*from,*to) when they are close */
+static void warmsec(CORE_HANDLE *ch, unsigned int i, unsigned int *from, unsigned int *to){
+    unsigned int off = ch->offsets[i], size = ch->heads[i].size;
+    if(off > ch->end-ch->Coffset) return;
+    off += ch->Coffset;
+    if(size > ch->end-off) size = ch->end-off;
+    if(off >= *from && off <= *to+WARMGAP){
+        if(off+size > *to) *to = off+size;
+        return;
+    }
+    warmrange(ch,*from,*to-*from);
+    *from = off;
+    *to = off+size;
+}
+
+/* module sections that do not run at startup */
+static void warmmodules(CORE_HANDLE *ch){
+    unsigned int from = 0, to = 0;
+    for(unsigned int i = 0;i<ch->chead.nofsec;i++){
+        BYTE c = ch->heads[i].Characteristics;
+        if((c & (0x02|0x04|0x08)) && !(c & 0x01)) warmsec(ch,i,&from,&to);
+    }
+    warmrange(ch,from,to-from);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI warmthread(LPVOID ch){
+    warmmodules((CORE_HANDLE *)ch);
+    return 0;
+}
+#else
+static void *warmthread(void *ch){
+    warmmodules((CORE_HANDLE *)ch);
+    return NULL;
+}
+#endif
+
+/* ch must stay open for as long as the process runs, like the bundle pmain loads */
+static void chwarm(CORE_HANDLE *ch){
+    unsigned int from = 0, to = 0;
+#if defined(_WIN32)
+    HANDLE t;
+    prefetchvm = (PFVM)GetProcAddress(GetModuleHandleA("kernel32.dll"),"PrefetchVirtualMemory");
+#else
+    pthread_t t;
+#endif
+    if(ch->autorun != NULL){
+        for(unsigned int k = 0;k<ch->nauto;k++)
+            if(ch->autorun[k] < ch->chead.nofsec) warmsec(ch,ch->autorun[k],&from,&to);
+    }else{
+        for(unsigned int i = 0;i<ch->chead.nofsec;i++)
+            if(ch->heads[i].Characteristics & 0x01) warmsec(ch,i,&from,&to);
+    }
+    warmrange(ch,from,to-from);
+    if(ch->autorun != NULL && ch->nauto >= ch->chead.nofsec) return; /* nothing left to require */
+#if defined(_WIN32)
+    if((t = CreateThread(NULL,0,warmthread,ch,0,NULL)) != NULL) CloseHandle(t);
+#else
+    if(pthread_create(&t,NULL,warmthread,ch) == 0) pthread_detach(t);
+#endif
+}
+
+#if defined(_WIN32)
+
 typedef struct{
     bool isfmemmod;
+    CORE_HANDLE *ch; /* bundle the module came from; its dependencies are looked up there */
 }MMODULE,*PMMODULE;
 
 static HCUSTOMMODULE _LoadLibraryLua(LPCSTR filename, void *userdata);
@@ -476,18 +1615,19 @@ static HCUSTOMMODULE _LoadLibraryLua(LPCSTR filename, void *userdata)
     PMMODULE hmm = (PMMODULE)userdata;
     hmm->isfmemmod = 0;
     if((strcmp(filename,"lua51.dll") == 0)||(strcmp(filename,"lua5.1.dll") == 0)){return (HCUSTOMMODULE) GetModuleHandle(0);}
-    for (unsigned int i = 0;i<C_ch->chead.nofsec;i++){
-        if(strcmp(C_ch->heads[i].name,filename) == 0){
-            if((C_ch->heads[i].Characteristics & 0x08) == 0x08){
-                    uint8_t *data = malloc(C_ch->heads[i].size);
-                    fseek(C_ch->f,C_ch->offsets[i],SEEK_SET);
-                    fread(data,C_ch->heads[i].size,1,C_ch->f);
-                    PMMODULE mm = malloc(sizeof(MMODULE));
-                    mm->isfmemmod = 0;
-                    hmm->isfmemmod = 1;
-                    return (HCUSTOMMODULE) MemoryLoadLibraryEx(data,_LoadLibraryLua,_GetProcAddressLua,_FreeLibraryLua,mm);
-            }
-        }
+    int i = (hmm->ch != NULL) ? chfind(hmm->ch,filename,0x08) : -1;
+    if(i >= 0){
+        size_t size;
+        uint8_t *copy;
+        const uint8_t *data = secdata(hmm->ch,i,&size,&copy);
+        if(data == NULL) return NULL;
+        PMMODULE mm = malloc(sizeof(MMODULE));
+        mm->isfmemmod = 0;
+        mm->ch = hmm->ch;
+        hmm->isfmemmod = 1;
+        HCUSTOMMODULE result = (HCUSTOMMODULE) MemoryLoadLibraryEx(data,_LoadLibraryLua,_GetProcAddressLua,_FreeLibraryLua,mm);
+        free(copy); /* MemoryModule keeps its own copy of the image */
+        return result;
     }
     HMODULE result = LoadLibraryA(filename);
     if (result == NULL) {
@@ -519,16 +1659,134 @@ static void _FreeLibraryLua(HCUSTOMMODULE module, void *userdata)
     }
 }
 
-/* prefix for open functions in C libraries */
-#define LUA_POF		"luaopen_"
+#endif
 
-/* separator for open functions in C libraries */
-#define LUA_OFSEP	"_"
+#if defined(__linux__)
 
-#define POF		LUA_POF
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC	0x0001U
+#endif
 
-static const char *mkfuncname (lua_State *L, const char *modname) {
-  const char *funcname;
+#if UINTPTR_MAX > 0xffffffffu
+typedef Elf64_Ehdr ELF_EHDR;
+typedef Elf64_Phdr ELF_PHDR;
+typedef Elf64_Dyn ELF_DYN;
+#else
+typedef Elf32_Ehdr ELF_EHDR;
+typedef Elf32_Phdr ELF_PHDR;
+typedef Elf32_Dyn ELF_DYN;
+#endif
+
+static void *memdlopen(CORE_HANDLE *ch, unsigned int n, int mode);
+
+/* file offset of a virtual address, through the PT_LOAD segments */
+static size_t elfvtoo(const ELF_PHDR *ph, unsigned int phnum, uint64_t vaddr){
+    for(unsigned int i = 0;i<phnum;i++){
+        if(ph[i].p_type == PT_LOAD && vaddr >= ph[i].p_vaddr && vaddr < ph[i].p_vaddr+ph[i].p_filesz)
+            return vaddr-ph[i].p_vaddr+ph[i].p_offset;
+    }
+    return (size_t)-1;
+}
+
+/*
+** resolve the DT_NEEDED entries of an embedded shared object the way
+** _LoadLibraryLua does on Windows: a 0x08 section with that name is
+** loaded from memory (RTLD_GLOBAL, so the dynamic linker matches it by
+** its SONAME), anything else is left to the system search path
+*/
+static void memdeps(CORE_HANDLE *ch, const uint8_t *data, size_t size){
+    const ELF_EHDR *eh = (const ELF_EHDR *)data;
+    const ELF_PHDR *ph;
+    const ELF_DYN *dyn = NULL;
+    size_t ndyn = 0, strtab = (size_t)-1, strsz = 0;
+    if(size < sizeof(ELF_EHDR) || memcmp(eh->e_ident,ELFMAG,SELFMAG) != 0) return;
+    if(eh->e_phoff > size || (size-eh->e_phoff)/sizeof(ELF_PHDR) < eh->e_phnum) return;
+    ph = (const ELF_PHDR *)(data+eh->e_phoff);
+    for(unsigned int i = 0;i<eh->e_phnum;i++){
+        if(ph[i].p_type == PT_DYNAMIC && ph[i].p_offset <= size && ph[i].p_filesz <= size-ph[i].p_offset){
+            dyn = (const ELF_DYN *)(data+ph[i].p_offset);
+            ndyn = ph[i].p_filesz/sizeof(ELF_DYN);
+        }
+    }
+    for(size_t i = 0;i<ndyn && dyn[i].d_tag != DT_NULL;i++){
+        if(dyn[i].d_tag == DT_STRTAB) strtab = elfvtoo(ph,eh->e_phnum,dyn[i].d_un.d_ptr);
+        if(dyn[i].d_tag == DT_STRSZ) strsz = dyn[i].d_un.d_val;
+    }
+    if(strtab >= size || strsz > size-strtab) return;
+    for(size_t i = 0;i<ndyn && dyn[i].d_tag != DT_NULL;i++){
+        if(dyn[i].d_tag == DT_NEEDED && dyn[i].d_un.d_val < strsz){
+            const char *dep = (const char *)data+strtab+dyn[i].d_un.d_val;
+            int j;
+            if(memchr(dep,'\0',strsz-dyn[i].d_un.d_val) == NULL) continue;
+            j = chfind(ch,dep,0x08);
+            if(j >= 0) memdlopen(ch,j,RTLD_NOW|RTLD_GLOBAL);
+        }
+    }
+}
+
+/* ch->dl[n] while section n and its dependencies are being loaded */
+static char dlbusy;
+
+/*
+** dlopen the shared object in section n through an anonymous memfd;
+** NULL for a section already being loaded, i.e. a DT_NEEDED cycle
+*/
+static void *memdlopen(CORE_HANDLE *ch, unsigned int n, int mode){
+    size_t size;
+    uint8_t *copy;
+    const uint8_t *data;
+    char path[32];
+    void *h = NULL;
+    int fd;
+    chlock(ch); /* one dlopen per section, whichever thread asks first */
+    if(ch->dl == NULL && (ch->dl = calloc(ch->chead.nofsec+1,sizeof(void *))) == NULL){
+        chunlock(ch);
+        return NULL;
+    }
+    if(ch->dl[n] != NULL || (data = secdata(ch,n,&size,&copy)) == NULL){
+        h = (ch->dl[n] != &dlbusy) ? ch->dl[n] : NULL;
+        chunlock(ch);
+        return h;
+    }
+    ch->dl[n] = &dlbusy;
+    memdeps(ch,data,size);
+    fd = syscall(SYS_memfd_create,(const char *)ch->heads[n].name,MFD_CLOEXEC);
+    if(fd >= 0){
+        size_t done = 0;
+        while(done < size){
+            ssize_t w = write(fd,data+done,size-done);
+            if(w <= 0 && errno != EINTR) break;
+            if(w > 0) done += w;
+        }
+        if(done == size){
+            snprintf(path,sizeof(path),"/proc/self/fd/%d",fd);
+            h = dlopen(path,mode);
+        }
+        /*
+        ** the dynamic linker identifies objects by path, so the descriptor
+        ** stays open while the object may be loaded; a reused fd number
+        ** would otherwise hand back an earlier object
+        */
+        if(h == NULL) close(fd);
+    }
+    free(copy);
+    ch->dl[n] = (mode & RTLD_GLOBAL) ? h : NULL;  /* dependencies are shared */
+    chunlock(ch);
+    return h;
+}
+
+#endif
+
+/* prefix for open functions in C libraries */
+#define LUA_POF		"luaopen_"
+
+/* separator for open functions in C libraries */
+#define LUA_OFSEP	"_"
+
+#define POF		LUA_POF
+
+static const char *mkfuncname (lua_State *L, const char *modname) {
+  const char *funcname;
   const char *mark = strchr(modname, *LUA_IGMARK);
   if (mark) modname = mark + 1;
   funcname = luaL_gsub(L, modname, ".", LUA_OFSEP);
@@ -539,6 +1797,7 @@ static const char *mkfuncname (lua_State *L, const char *modname) {
 
 #define LIBPREFIX	"LOADLIB: "
 
+#if defined(_WIN32) || defined(__linux__)
 static void **ll_register (lua_State *L, const char *path) {
   void **plib;
   lua_pushfstring(L, "%s%s", LIBPREFIX, path);
@@ -557,25 +1816,70 @@ static void **ll_register (lua_State *L, const char *path) {
   }
   return plib;
 }
+#endif
+
+#define LUA_PLUAREQUIRE		"PLUAREQUIRE*"
+
+/* bundle require searches in this state: the one set with h:setrequire, else the executable's */
+static CORE_HANDLE *reqbundle(lua_State *L){
+    CORE_HANDLE **ch;
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_PLUAREQUIRE);
+    ch = (CORE_HANDLE **)lua_touserdata(L, -1);  /* the registry keeps it alive */
+    lua_pop(L, 1);
+    return (ch != NULL && *ch != NULL) ? *ch : g_ch;
+}
 
-int llib(lua_State* state,const char *name,const char *init,unsigned int secn){
+int llib(lua_State* state,CORE_HANDLE *ch,const char *name,const char *init,unsigned int secn){
     unsigned int n = secn;
-    if(C_ch != NULL){
-        if((C_ch->chead.conf[3] & 0x08) == 0x08){
+#if defined(__linux__)
+    if(ch != NULL){
+        if((ch->chead.conf[3] & 0x08) == 0x08){
             if(name != NULL){
-                    for (unsigned int i = 0;i<C_ch->chead.nofsec;i++){
-                        if((strcmp(C_ch->heads[i].name,name) == 0)&&((C_ch->heads[i].Characteristics & 0x04) == 0x04)){
-                           n = i;
-                        }
-                    }
+                    int i = chfind(ch,name,0x04);
+                    if(i >= 0) n = i;
+            }
+            void **reg = ll_register(state, name);
+            if (*reg == NULL) {
+                (void)dlerror();  /* report only what this load leaves */
+                errno = 0;
+                *reg = memdlopen(ch,n,RTLD_NOW|RTLD_LOCAL);
+            }
+            if (*reg == NULL) {
+                const char *e = dlerror();
+                if (e != NULL) lua_pushstring(state, e);
+                else  /* failed before dlopen: section data, memfd or its write */
+                    lua_pushfstring(state,"cannot load embedded C module " LUA_QS ": %s",
+                                    (name != NULL) ? name : (const char *)ch->heads[n].name,
+                                    (errno != 0) ? strerror(errno) : "section is corrupted");
+                return 0;
             }
-            unsigned char* data = malloc(C_ch->heads[n].size); //Allocating Memory for DLL Data
-            fseek(C_ch->f,C_ch->offsets[n],SEEK_SET); //Seeking To DLL Address
-            fread(data,C_ch->heads[n].size,1,C_ch->f); //Reading To Memory
+            lua_CFunction f = (lua_CFunction)dlsym(*reg, init);
+            if (f == NULL)
+              return 0;  /* unable to find function */
+            lua_pushcfunction(state, f);
+            return 1;
+        }
+    }
+#elif !defined(_WIN32)
+    (void)n;
+    lua_pushfstring(state,"cannot load embedded C module " LUA_QS ": not supported on this platform",name);
+#else
+    if(ch != NULL){
+        if((ch->chead.conf[3] & 0x08) == 0x08){
+            if(name != NULL){
+                    int i = chfind(ch,name,0x04);
+                    if(i >= 0) n = i;
+            }
+            size_t size;
+            uint8_t *copy;
+            const uint8_t *data = secdata(ch,n,&size,&copy); //DLL Data, Straight From The Mapping When Possible
+            if(data == NULL) return 0;
             PMMODULE mm = malloc(sizeof(MMODULE)); //Allocating Memory For UserData
             mm->isfmemmod = 0; //Set It To Default
+            mm->ch = ch; //Dependencies Come From The Same Bundle
             void **reg = ll_register(state, name); //Registering C Function
             if (*reg == NULL) *reg = MemoryLoadLibraryEx(data,_LoadLibraryLua,_GetProcAddressLua,_FreeLibraryLua,mm); //Load DLL From Memory
+            free(copy); //MemoryModule Copied The Sections
             if (*reg == NULL) //Check if Loaded
                 return 0;
             else {
@@ -587,23 +1891,24 @@ int llib(lua_State* state,const char *name,const char *init,unsigned int secn){
             return 1;
         }
     }
+#endif
     return 0;
 }
 
 int MyLoader(lua_State* state) {
-    if(C_ch != NULL){
+    CORE_HANDLE *ch = reqbundle(state);
+    if(ch != NULL){
         const char *name = luaL_checkstring(state, 1);
-        for (unsigned int i = 0;i<C_ch->chead.nofsec;i++){
-            if(strcmp(C_ch->heads[i].name,name) == 0){
-                if((C_ch->heads[i].Characteristics & 0x02) == 0x02){
-                    load(state,C_ch->f,name,C_ch->offsets[i],C_ch->heads[i].size);
-                    return 1;
-                }else if((C_ch->heads[i].Characteristics & 0x04) == 0x04){
-                    const char *funcname;
-                    funcname = mkfuncname(state,name);
-                    llib(state,name,funcname,i);
-                    return 1;
-                }
+        int i = chfind(ch,name,0x02|0x04);
+        if(i >= 0){
+            if((ch->heads[i].Characteristics & 0x02) == 0x02){
+                loadsection(state,ch,i);
+                return 1;
+            }else{
+                const char *funcname;
+                funcname = mkfuncname(state,name);
+                llib(state,ch,name,funcname,i);
+                return 1;
             }
         }
     }
@@ -611,6 +1916,49 @@ int MyLoader(lua_State* state) {
     return 0;
 }
 
+/* package.preload entry for module section i of the startup bundle */
+static int preloader(lua_State *L){
+    unsigned int i = lua_tointeger(L, lua_upvalueindex(1));
+    const char *name = luaL_checkstring(L, 1);
+    if(g_ch->heads[i].Characteristics & 0x02){
+        loadsection(L,g_ch,i);
+    }else{
+        /* the entry stays bound to this bundle after setrequire */
+        if(!llib(L,g_ch,name,mkfuncname(L,name),i)) luaL_error(L,"cannot load embedded C module " LUA_QS,name);
+    }
+    lua_pushstring(L,name);
+    lua_call(L,1,1);
+    return 1;
+}
+
+/*
+** conf 0x10: fill package.preload with a loader for every embedded module
+** up front, so require finds them with one table lookup and never reaches
+** the searchers. The lowest section of a name wins, as with MyLoader
+*/
+static void preloadall(lua_State *L, CORE_HANDLE *ch){
+    BYTE mask = (ch->chead.conf[3] & 0x08) ? (0x02|0x04) : 0x02;
+    lua_getglobal(L,"package");
+    if(!lua_istable(L,-1)){
+        lua_pop(L,1);
+        return;
+    }
+    lua_getfield(L,-1,"preload");
+    if(lua_istable(L,-1)){
+        for(unsigned int i = 0;i<ch->chead.nofsec;i++){
+            if(!(ch->heads[i].Characteristics & mask) || !chsec(ch,i)) continue;
+            lua_getfield(L,-1,(const char *)ch->heads[i].name);
+            if(lua_isnil(L,-1)){
+                lua_pushinteger(L,i);
+                lua_pushcclosure(L,preloader,1);
+                lua_setfield(L,-3,(const char *)ch->heads[i].name);
+            }
+            lua_pop(L,1);
+        }
+    }
+    lua_pop(L,2);
+}
+
 
 
 #define LUA_FPLUAHANDLE		"FPLUA*"
@@ -639,12 +1987,13 @@ static int plua_read(lua_State *L){
     if(g_ch != NULL){
     unsigned int n = luaL_checknumber(L, 1);
     if(n > 0){
-        if(n < g_ch->chead.nofsec+1){
-            unsigned char *data = malloc(g_ch->heads[n-1].size);
-            fseek(g_ch->f,g_ch->offsets[n-1],SEEK_SET);
-            fread(data,g_ch->heads[n-1].size,1,g_ch->f);
-            lua_pushlstring(L,data,g_ch->heads[n-1].size);
-            free(data);
+        if(n < g_ch->chead.nofsec+1 && chsec(g_ch,n-1)){
+            size_t size;
+            uint8_t *copy;
+            const uint8_t *p = secdata(g_ch,n-1,&size,&copy);
+            if(p == NULL) return 0;
+            lua_pushlstring(L,(const char *)p,size);
+            free(copy);
             return 1;
         }
     }
@@ -655,12 +2004,11 @@ static int plua_read(lua_State *L){
 static int plua_getn(lua_State *L){
     if(g_ch != NULL){
     const char *name = luaL_checkstring(L, 1);
-    for (unsigned int i = 0;i<g_ch->chead.nofsec;i++){
-        if(strcmp(g_ch->heads[i].name,name) == 0){
-            lua_pushinteger(L,i+1);
-            return 1;
-        }
-	}
+    int i = chfind(g_ch,name,0);
+    if(i >= 0){
+        lua_pushinteger(L,i+1);
+        return 1;
+    }
     }
 	return 0;
 }
@@ -670,7 +2018,7 @@ static int plua_list(lua_State *L){
     lua_newtable(L);
     for (unsigned int i = 0;i<g_ch->chead.nofsec;i++){
         lua_newtable(L);
-        lua_pushstring(L,g_ch->heads[i].name);
+        lua_pushlstring(L,(const char *)g_ch->heads[i].name,strnlen((const char *)g_ch->heads[i].name,sizeof(g_ch->heads[i].name)));
         lua_rawseti(L,-2,1);
         lua_pushinteger(L,g_ch->heads[i].size);
         lua_rawseti(L,-2,2);
@@ -682,46 +2030,246 @@ static int plua_list(lua_State *L){
     return 1;
 }
 
+#define LUA_PLUAVIEW		"PLUAVIEW*"
+
+/*
+** read-only byte slice of a section. Views of mapped sections point into
+** the mapping and pin their handle; the others own the decompressed copy.
+** Slices made by sub keep their parent alive through their environment.
+*/
+typedef struct{
+    const uint8_t *p;
+    size_t len;
+    CORE_HANDLE *ch;
+    uint8_t *copy;
+} VIEW;
+
+#define toview(L,i)	((VIEW *)luaL_checkudata(L, i, LUA_PLUAVIEW))
+
+static ptrdiff_t vpos(ptrdiff_t pos, size_t len){
+    if(pos < 0) pos += (ptrdiff_t)len + 1;  /* negative means back from the end */
+    return (pos >= 0) ? pos : 0;
+}
+
+static VIEW *newview(lua_State *L, const uint8_t *p, size_t len){
+    VIEW *v = (VIEW *)lua_newuserdata(L,sizeof(VIEW));
+    v->p = p;
+    v->len = len;
+    v->ch = NULL;
+    v->copy = NULL;
+    luaL_getmetatable(L, LUA_PLUAVIEW);
+    lua_setmetatable(L, -2);
+    return v;
+}
+
+static int pushview(lua_State *L, CORE_HANDLE *ch, unsigned int n){
+    size_t size;
+    uint8_t *copy;
+    const uint8_t *p;
+    VIEW *v;
+    if(n == 0 || n > ch->chead.nofsec || !chsec(ch,n-1)) return 0;
+    v = newview(L,NULL,0);
+    if((p = secdata(ch,n-1,&size,&copy)) == NULL){
+        lua_pop(L,1);
+        return 0;
+    }
+    v->p = p;
+    v->len = size;
+    v->copy = copy;
+    if(copy == NULL){
+        v->ch = ch;
+        chretain(ch);
+    }
+    return 1;
+}
+
+/* slice [i,j] of the view at index 1, keeping it alive */
+static VIEW *subview(lua_State *L, VIEW *v, ptrdiff_t i, ptrdiff_t j){
+    if(i <= 0) i = 1;
+    if((size_t)j > v->len) j = v->len;
+    VIEW *s = newview(L,(i <= j) ? v->p+i-1 : v->p,(i <= j) ? (size_t)(j-i+1) : 0);
+    lua_createtable(L,1,0);
+    lua_pushvalue(L,1);
+    lua_rawseti(L,-2,1);
+    lua_setfenv(L,-2);
+    return s;
+}
+
+static int view_sub(lua_State *L){
+    VIEW *v = toview(L,1);
+    subview(L,v,vpos(luaL_optinteger(L,2,1),v->len),vpos(luaL_optinteger(L,3,-1),v->len));
+    return 1;
+}
+
+static int view_byte(lua_State *L){
+    VIEW *v = toview(L,1);
+    ptrdiff_t posi = vpos(luaL_optinteger(L,2,1),v->len);
+    ptrdiff_t pose = vpos(luaL_optinteger(L,3,posi),v->len);
+    int n;
+    if(posi <= 0) posi = 1;
+    if((size_t)pose > v->len) pose = v->len;
+    if(posi > pose) return 0;
+    n = (int)(pose - posi + 1);
+    if(posi + n <= pose) luaL_error(L,"view slice too long");
+    luaL_checkstack(L,n,"view slice too long");
+    for(int i = 0;i<n;i++) lua_pushinteger(L,v->p[posi+i-1]);
+    return n;
+}
+
+/* plain find of a string or view, like string.find(s, pattern, init, true) */
+static int view_find(lua_State *L){
+    VIEW *v = toview(L,1);
+    const uint8_t *pat;
+    size_t plen;
+    ptrdiff_t init = vpos(luaL_optinteger(L,3,1),v->len);
+    if(lua_type(L,2) == LUA_TUSERDATA){
+        VIEW *w = toview(L,2);
+        pat = w->p;
+        plen = w->len;
+    }else{
+        pat = (const uint8_t *)luaL_checklstring(L,2,&plen);
+    }
+    if(init <= 0) init = 1;
+    if((size_t)init > v->len+1){
+        lua_pushnil(L);
+        return 1;
+    }
+    const uint8_t *at = v->p+init-1, *end = v->p+v->len;
+    if(plen == 0){
+        lua_pushinteger(L,init);
+        lua_pushinteger(L,init-1);
+        return 2;
+    }
+    while((size_t)(end-at) >= plen && (at = memchr(at,pat[0],(end-at)-plen+1)) != NULL){
+        if(memcmp(at+1,pat+1,plen-1) == 0){
+            lua_pushinteger(L,at-v->p+1);
+            lua_pushinteger(L,at-v->p+plen);
+            return 2;
+        }
+        at++;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+/* the contents (or [i,j] of them) as a Lua string */
+static int view_string(lua_State *L){
+    VIEW *v = toview(L,1);
+    ptrdiff_t i = vpos(luaL_optinteger(L,2,1),v->len);
+    ptrdiff_t j = vpos(luaL_optinteger(L,3,-1),v->len);
+    if(i <= 0) i = 1;
+    if((size_t)j > v->len) j = v->len;
+    lua_pushlstring(L,(const char *)v->p+i-1,(i <= j) ? (size_t)(j-i+1) : 0);
+    return 1;
+}
+
+static int view_bytesnext(lua_State *L){
+    VIEW *v = toview(L,1);
+    lua_Integer i = luaL_checkinteger(L,2)+1;
+    if(i < 1 || (size_t)i > v->len) return 0;
+    lua_pushinteger(L,i);
+    lua_pushinteger(L,v->p[i-1]);
+    return 2;
+}
+
+/* for i, b in v:bytes() */
+static int view_bytes(lua_State *L){
+    toview(L,1);
+    lua_pushcfunction(L,view_bytesnext);
+    lua_pushvalue(L,1);
+    lua_pushinteger(L,0);
+    return 3;
+}
+
+static int view_chunksnext(lua_State *L){
+    VIEW *v = toview(L,1);
+    lua_Integer size = lua_tointeger(L,lua_upvalueindex(1));
+    lua_Integer i = luaL_checkinteger(L,2)+size;
+    if(i < 1 || (size_t)i > v->len) return 0;
+    lua_pushinteger(L,i);
+    subview(L,v,i,i+size-1);
+    return 2;
+}
+
+/* for pos, slice in v:chunks(size) */
+static int view_chunks(lua_State *L){
+    toview(L,1);
+    lua_Integer size = luaL_checkinteger(L,2);
+    luaL_argcheck(L,size > 0,2,"chunk size must be positive");
+    lua_pushinteger(L,size);
+    lua_pushcclosure(L,view_chunksnext,1);
+    lua_pushvalue(L,1);
+    lua_pushinteger(L,1-size);
+    return 3;
+}
+
+static int view_len(lua_State *L){
+    lua_pushinteger(L,toview(L,1)->len);
+    return 1;
+}
+
+static int view_tostring(lua_State *L){
+    VIEW *v = toview(L,1);
+    lua_pushfstring(L,"plua.view (%p, %d bytes)",(void *)v,(int)v->len);
+    return 1;
+}
+
+static int view_gc(lua_State *L){
+    VIEW *v = toview(L,1);
+    free(v->copy);
+    v->copy = NULL;
+    if(v->ch != NULL) chrelease(v->ch);
+    v->ch = NULL;
+    v->p = NULL;
+    v->len = 0;
+    return 0;
+}
+
+static int plua_view(lua_State *L){
+    return (g_ch != NULL) ? pushview(L,g_ch,luaL_checkinteger(L,1)) : 0;
+}
+
+static const luaL_Reg viewlib[] = {
+  {"sub",           view_sub},
+  {"byte",          view_byte},
+  {"find",          view_find},
+  {"string",        view_string},
+  {"bytes",         view_bytes},
+  {"chunks",        view_chunks},
+  {"len",           view_len},
+  {"__len",         view_len},
+  {"__tostring",    view_tostring},
+  {"__gc",          view_gc},
+  {NULL, NULL}
+};
+
 CORE_HANDLE* pluaload(const char* fname){
-    CORE_HANDLE *ch = malloc(sizeof(CORE_HANDLE));
     FILE *f = fopen(fname,"r+b");
     if(f == NULL) return NULL;
-    ch->f = f;
-    int currpos;
-    ch->_io = 0;
-    SIGNATURE sig;
-    fread(sig,sizeof(SIGNATURE),1,f);
-    ch->Coffset = sizeof(SIGNATURE);
-    if(memcmp(&luasig,&sig,sizeof(SIGNATURE)) == 0){
-        fread(&ch->chead,sizeof(CORE_HEADER),1,f);
-        ch->heads = malloc(sizeof(SECTION_HEADER)*ch->chead.nofsec);
-        ch->offsets = malloc(sizeof(unsigned int)*(ch->chead.nofsec+1));
-        fread(ch->heads,sizeof(SECTION_HEADER),ch->chead.nofsec,f);
-        ch->pos = malloc(sizeof(unsigned int)*ch->chead.nofsec+1);
-        currpos = ch->Coffset+sizeof(CORE_HEADER)+sizeof(SECTION_HEADER)*ch->chead.nofsec;
-        for(unsigned int i = 0; i < ch->chead.nofsec; i++){
-             ch->heads[i].name[58] = '\0';
-             if(!checkString(ch->heads[i].name)){return 0;}
-             if(((ch->heads[i].Characteristics & 0x10) == 0x10)&&(i != 0)){
-                ch->offsets[i] = ch->offsets[i-1];
-                ch->heads[i].size = ch->heads[i-1].size;
-                ch->heads[i].Characteristics = ch->heads[i-1].Characteristics;
-             }else{
-             ch->offsets[i] = currpos;
-             currpos += ch->heads[i].size;
-             }
-             ch->pos[i] = 0;
-         }
-         ch->offsets[ch->chead.nofsec] = currpos;
-         ch->pos[ch->chead.nofsec] = 0;
-    }else{
+    CORE_HANDLE *ch = chnew(f);
+    if(ch == NULL){
+        fclose(f);
+        return NULL;
+    }
+    if(!chparse(ch,0)){
+        chclose(ch);
         return NULL;
     }
     return ch;
 }
 
+/* new Lua handle sharing the loaded bundle ch */
+static void pushhandle(lua_State *L, CORE_HANDLE *ch){
+    CORE_HANDLE **p = (CORE_HANDLE **)lua_newuserdata(L,sizeof(CORE_HANDLE*));
+    *p = ch;
+    chretain(ch);
+    luaL_getmetatable(L, LUA_FPLUAHANDLE);
+    lua_setmetatable(L, -2);
+}
+
 static int plua_load(lua_State *L){
     CORE_HANDLE **ch = (CORE_HANDLE **)lua_newuserdata(L,sizeof(CORE_HANDLE*));
+    *ch = NULL;
     luaL_getmetatable(L, LUA_FPLUAHANDLE);
     lua_setmetatable(L, -2);
     const char* fname = lua_tostring(L,1);
@@ -732,7 +2280,7 @@ static int plua_load(lua_State *L){
 static int plua_new(lua_State *L){
     unsigned int n = luaL_checknumber(L, 1);
     CORE_HANDLE **ch = (CORE_HANDLE **)lua_newuserdata(L,sizeof(CORE_HANDLE*));
-    *ch = malloc(sizeof(CORE_HANDLE));
+    *ch = calloc(1,sizeof(CORE_HANDLE));
     luaL_getmetatable(L, LUA_FPLUAHANDLE);
     lua_setmetatable(L, -2);
     (*ch)->_io = 1;
@@ -740,6 +2288,7 @@ static int plua_new(lua_State *L){
     memset((*ch)->chead.conf,0,sizeof(int));
     (*ch)->wtype = malloc(sizeof(uint8_t)*n+1);
     memset((*ch)->wtype,0,sizeof(uint8_t)*n+1);
+    (*ch)->wflags = calloc(n+1,sizeof(uint8_t));
     (*ch)->data = malloc(sizeof(void*)*n+1);
     (*ch)->heads = malloc(sizeof(SECTION_HEADER)*n+1);
     memset((*ch)->heads,0,sizeof(SECTION_HEADER)*n+1);
@@ -753,12 +2302,13 @@ static int fplua_read(lua_State *L){
         if((*ch)->_io == 0){
             unsigned int n = luaL_checkinteger(L, 2);
             if(n > 0){
-                if(n < (*ch)->chead.nofsec+1){
-                    unsigned char *data = malloc((*ch)->heads[n-1].size);
-                    fseek((*ch)->f,(*ch)->offsets[n-1],SEEK_SET);
-                    fread(data,(*ch)->heads[n-1].size,1,(*ch)->f);
-                    lua_pushlstring(L,data,(*ch)->heads[n-1].size);
-                    free(data);
+                if(n < (*ch)->chead.nofsec+1 && chsec(*ch,n-1)){
+                    size_t size;
+                    uint8_t *copy;
+                    const uint8_t *p = secdata(*ch,n-1,&size,&copy);
+                    if(p == NULL) return 0;
+                    lua_pushlstring(L,(const char *)p,size);
+                    free(copy);
                     return 1;
                 }
             }
@@ -769,6 +2319,42 @@ static int fplua_read(lua_State *L){
     return 0;
 }
 
+static int fplua_view(lua_State *L){
+    CORE_HANDLE **ch = tochp(L);
+    if(*ch == NULL) closed(L);
+    return ((*ch)->_io == 0) ? pushview(L,*ch,luaL_checkinteger(L,2)) : 0;
+}
+
+/* check section n, or every section, against its checksum now: true, or false and the first bad one */
+static int verifysecs(lua_State *L, CORE_HANDLE *ch, int arg){
+    unsigned int first = 0, last = ch->chead.nofsec;
+    if(!lua_isnoneornil(L,arg)){
+        unsigned int n = luaL_checkinteger(L,arg);
+        luaL_argcheck(L, n > 0 && n <= last, arg, "no such section");
+        first = n-1;
+        last = n;
+    }
+    for(unsigned int i = first;i<last;i++){
+        if(!chverify(ch,i)){
+            lua_pushboolean(L,0);
+            lua_pushinteger(L,i+1);
+            return 2;
+        }
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int plua_verify(lua_State *L){
+    return (g_ch != NULL) ? verifysecs(L,g_ch,1) : 0;
+}
+
+static int fplua_verify(lua_State *L){
+    CORE_HANDLE **ch = tochp(L);
+    if(*ch == NULL) closed(L);
+    return ((*ch)->_io == 0) ? verifysecs(L,*ch,2) : 0;
+}
+
 static int fplua_getnofsec(lua_State *L){
     CORE_HANDLE **ch = tochp(L);
     if(*ch != NULL){
@@ -802,9 +2388,12 @@ static int fplua_setconf(lua_State *L){
         }
         memcpy(&((*ch)->chead.conf),&data,sizeof(int));
             if((*ch)->_io != 1){
-                unsigned int p = (*ch)->Coffset + sizeof(sizeof(int));
+                unsigned int p = (*ch)->Coffset + offsetof(CORE_HEADER,conf);
+                chlock(*ch);
                 fseek((*ch)->f,p,SEEK_SET);
                 fwrite(&(*ch)->chead.conf,sizeof(int),1,(*ch)->f);
+                fflush((*ch)->f);
+                chunlock(*ch);
             }
     }else{
         closed(L);
@@ -818,11 +2407,29 @@ static int fplua_setsconf(lua_State *L){
         unsigned int n = luaL_checkinteger(L,2);
         if(n > 0 && n < (*ch)->chead.nofsec+1){
             uint8_t c = (uint8_t)luaL_checkinteger(L,3);
+            if(!chedit(*ch)) return 0;
+            if((*ch)->_io != 1 && (*ch)->nauto != XSTALE && (*ch)->ver == BUNDLEVER
+               && (c & 0x01) && !((*ch)->heads[n-1].Characteristics & 0x01)){
+                /* the autorun list cannot grow in place: have pmain scan the headers */
+                uint32_t stale = XSTALE;
+                chlock(*ch);
+                fseek((*ch)->f,(*ch)->xoff + offsetof(CORE_INDEX,nauto),SEEK_SET);
+                fwrite(&stale,sizeof(stale),1,(*ch)->f);
+                chunlock(*ch);
+                chfree(*ch,(*ch)->autorun);
+                (*ch)->autorun = NULL;
+                (*ch)->nauto = XSTALE;
+            }
             memset(&(*ch)->heads[n-1].Characteristics,c,1);
             if((*ch)->_io != 1){
                 unsigned int p = (*ch)->Coffset + sizeof(CORE_HEADER) + ((n-1)*sizeof(SECTION_HEADER)) + sizeof((*ch)->heads[n-1].name);
-                fseek((*ch)->f,p,SEEK_SET);
-                fwrite(&(*ch)->heads[n-1].Characteristics,sizeof((*ch)->heads[n-1].Characteristics),1,(*ch)->f);
+                chlock(*ch);
+                if(!chjsync(*ch,n-1)){
+                    fseek((*ch)->f,p,SEEK_SET);
+                    fwrite(&(*ch)->heads[n-1].Characteristics,sizeof((*ch)->heads[n-1].Characteristics),1,(*ch)->f);
+                    fflush((*ch)->f);
+                }
+                chunlock(*ch);
             }
         }
     }else{
@@ -836,11 +2443,10 @@ static int fplua_getn(lua_State *L){
     if(*ch != NULL){
         if((*ch)->_io == 0){
             const char *name = luaL_checkstring(L, 2);
-            for (unsigned int i = 0;i<(*ch)->chead.nofsec;i++){
-                if(strcmp((*ch)->heads[i].name,name) == 0){
-                    lua_pushinteger(L,i+1);
-                    return 1;
-                }
+            int i = chfind(*ch,name,0);
+            if(i >= 0){
+                lua_pushinteger(L,i+1);
+                return 1;
             }
         }
     }else{
@@ -855,7 +2461,7 @@ static int fplua_list(lua_State *L){
             lua_newtable(L);
             for (unsigned int i = 0;i<(*ch)->chead.nofsec;i++){
                 lua_newtable(L);
-                lua_pushstring(L,(*ch)->heads[i].name);
+                lua_pushlstring(L,(const char *)(*ch)->heads[i].name,strnlen((const char *)(*ch)->heads[i].name,sizeof((*ch)->heads[i].name)));
                 lua_rawseti(L,-2,1);
                 lua_pushinteger(L,(*ch)->heads[i].size);
                 lua_rawseti(L,-2,2);
@@ -874,7 +2480,8 @@ static int fplua_setR(lua_State *L){
     CORE_HANDLE **ch = tochp(L);
     if(*ch != NULL){
         if((*ch)->_io == 0){
-            C_ch = *ch;
+            pushhandle(L,*ch); /* its own reference: closing h leaves require working */
+            lua_setfield(L, LUA_REGISTRYINDEX, LUA_PLUAREQUIRE);
         }
     }else{
         closed(L);
@@ -882,6 +2489,74 @@ static int fplua_setR(lua_State *L){
     return 0;
 }
 
+/*
+** up to *size bytes of section i from its fseek position, in a single I/O:
+** points into the mapping or the builder's buffer when it can, otherwise
+** into *copy, which the caller frees. *size is cut down to what exists.
+*/
+static const uint8_t *secrange(CORE_HANDLE *ch, unsigned int i, size_t *size, uint8_t **copy){
+    unsigned int pos = ch->pos[i];
+    size_t avail = (pos < ch->heads[i].size) ? ch->heads[i].size-pos : 0;
+    const uint8_t *p;
+    *copy = NULL;
+    if(ch->_io == 0){
+        if(!chverify(ch,i)) return NULL;
+        if(ch->heads[i].Characteristics & 0x40){ /* heads[i].size is the packed size here */
+            State S;
+            ZHEADER zh;
+            if(chread(ch,&zh,choff(ch,i),sizeof(zh)) != sizeof(zh)) return NULL;
+            avail = (pos < zh.rawsize) ? zh.rawsize-pos : 0;
+            if(*size > avail) *size = avail;
+            if((*copy = malloc(*size+1)) == NULL) return NULL;
+            if(zh.blocksize & ZINDEX){ /* only the blocks under [pos, pos+size) */
+                if(zread(ch,i,&zh,pos,*copy,size)) return *copy;
+                free(*copy);
+                *copy = NULL;
+                return NULL;
+            }
+            sopen(&S,ch,choff(ch,i),ch->heads[i].size,1);
+            sskip(&S,pos);
+            *size = sread(&S,*copy,*size);
+            sclose(&S);
+            return *copy;
+        }
+        if(*size > avail) *size = avail;
+        if((p = chptr(ch,choff(ch,i)+pos,*size)) != NULL) return p;
+        if((*copy = malloc(*size+1)) == NULL) return NULL;
+        *size = chread(ch,*copy,choff(ch,i)+pos,*size);
+        return *copy;
+    }
+    if(ch->wtype[i] == 1){
+        if(*size > avail) *size = avail;
+        return ch->data[i].data+pos;
+    }
+    if(ch->wtype[i] == 2){
+        FILE *f = fopen(ch->data[i].filename,"rb");
+        if(f == NULL) return NULL;
+        if(*size > avail) *size = avail;
+        if((*copy = malloc(*size+1)) != NULL){
+            *size = (fseek(f,pos,SEEK_SET) == 0) ? fread(*copy,1,*size,f) : 0;
+        }
+        fclose(f);
+        return *copy;
+    }
+    return NULL;
+}
+
+/* bytes per element of fread type t (1 string of s bytes, 2 double, 3 int) */
+static size_t esize(unsigned int t, size_t s){
+    switch(t){
+        case 1: return s;
+        case 2: return sizeof(double);
+        case 3: return sizeof(int);
+    }
+    return 0;
+}
+
+/*
+** fread(n, t, c[, s]): c elements of type t from section n, read with one
+** I/O into a table sized up front; stops early at the end of the section
+*/
 static int fplua_fread(lua_State *L){
     CORE_HANDLE **ch = tochp(L);
     unsigned int n = luaL_checknumber(L, 2);
@@ -889,91 +2564,37 @@ static int fplua_fread(lua_State *L){
     unsigned int c = luaL_checknumber(L, 4);
     if(*ch != NULL){
             if(n > 0 && n < (*ch)->chead.nofsec+1){
-                if((*ch)->_io == 0){
-                    fseek((*ch)->f,(*ch)->offsets[n-1]+(*ch)->pos[n-1],SEEK_SET);
+                size_t es = esize(t,(t == 1) ? (size_t)luaL_checknumber(L, 5) : 0);
+                if(es == 0){ /* empty strings or an unknown type */
+                    lua_createtable(L,(t == 1) ? c : 0,0);
+                    for (unsigned int i = 0;t == 1 && i<c;i++){
+                        lua_pushliteral(L,"");
+                        lua_rawseti(L,-2,i+1);
+                    }
+                    return 1;
                 }
-                lua_newtable(L);
-                unsigned int p = 0;
-                for (unsigned int i = 0;i<c;i++){
-                    switch (t)
-                    {
-                        case 1:
-                            {
-                                unsigned int s = luaL_checknumber(L, 5);
-                                char *data = malloc(s);
-                                if((*ch)->_io == 0){
-                                    fread(data,s,1,(*ch)->f);
-                                }else{
-                                    if((*ch)->wtype[n-1] == 1){
-                                    memcpy(data,(*ch)->data[n-1].data+(*ch)->pos[n-1]+p,s);
-                                    p += s;
-                                    }else if((*ch)->wtype[n-1] == 2){
-                                        FILE *f = fopen((*ch)->data[n-1].filename,"rb");
-                                        if(f != NULL){
-                                            fseek(f,p,SEEK_SET);
-                                            fread(data,s,1,f);
-                                            p += s;
-                                            fclose(f);
-                                        }
-                                    }else{
-                                        return 0;
-                                    }
-                                }
-                                lua_pushlstring(L,data,s);
-                                lua_rawseti(L,-2,i+1);
-                                free(data);
-                            }
-                            break;
-                        case 2:{
-                                double data;
-                                if((*ch)->_io == 0){
-                                    fread(&data,sizeof(double),1,(*ch)->f);
-                                }else{
-                                    if((*ch)->wtype[n-1] == 1){
-                                    memcpy(&data,(*ch)->data[n-1].data+(*ch)->pos[n-1]+p,sizeof(double));
-                                    p += sizeof(double);
-                                    }else if((*ch)->wtype[n-1] == 2){
-                                        FILE *f = fopen((*ch)->data[n-1].filename,"rb");
-                                        if(f != NULL){
-                                            fseek(f,p,SEEK_SET);
-                                            fread(&data,sizeof(double),1,f);
-                                            p += sizeof(double);
-                                            fclose(f);
-                                        }
-                                    }else{
-                                    return 0;
-                                    }
-                                }
-                                lua_pushnumber(L,data);
-                                lua_rawseti(L,-2,i+1);
-                            }
-                            break;
-                        case 3:{
-                                int data;
-                                if((*ch)->_io == 0){
-                                    fread(&data,sizeof(int),1,(*ch)->f);
-                                }else{
-                                    if((*ch)->wtype[n-1] == 1){
-                                    memcpy(&data,(*ch)->data[n-1].data+(*ch)->pos[n-1]+p,sizeof(int));
-                                    p += sizeof(int);
-                                    }else if((*ch)->wtype[n-1] == 2){
-                                        FILE *f = fopen((*ch)->data[n-1].filename,"rb");
-                                        if(f != NULL){
-                                            fseek(f,p,SEEK_SET);
-                                            fread(&data,sizeof(int),1,f);
-                                            p += sizeof(int);
-                                            fclose(f);
-                                        }
-                                    }else{
-                                    return 0;
-                                    }
-                                }
-                                lua_pushinteger(L,data);
-                                lua_rawseti(L,-2,i+1);
-                            }
-                            break;
+                if(c > ((size_t)-1)/es) luaL_error(L,"too many elements");
+                size_t size = c*es;
+                uint8_t *copy;
+                const uint8_t *p = secrange(*ch,n-1,&size,&copy);
+                if(p == NULL) return 0;
+                c = size/es;
+                lua_createtable(L,c,0);
+                for (unsigned int i = 0;i<c;i++,p += es){
+                    if(t == 1){
+                        lua_pushlstring(L,(const char *)p,es);
+                    }else if(t == 2){
+                        double d;
+                        memcpy(&d,p,sizeof(d));
+                        lua_pushnumber(L,d);
+                    }else{
+                        int d;
+                        memcpy(&d,p,sizeof(d));
+                        lua_pushinteger(L,d);
                     }
+                    lua_rawseti(L,-2,i+1);
                 }
+                free(copy);
                 return 1;
         }
     }else{
@@ -982,31 +2603,892 @@ static int fplua_fread(lua_State *L){
     return 0;
 }
 
+typedef struct{
+    uint8_t *b;
+    size_t n;
+    size_t cap;
+} DUMPBUF;
+
+static int dumpwriter(lua_State *L, const void *p, size_t size, void *ud){
+    DUMPBUF *d = (DUMPBUF *)ud;
+    (void)L;
+    if(size == 0) return 0;
+    if(d->n+size > d->cap){
+        size_t cap = (d->cap == 0) ? 4096 : d->cap;
+        while(cap < d->n+size) cap <<= 1;
+        uint8_t *b = realloc(d->b,cap);
+        if(b == NULL) return 1;
+        d->b = b;
+        d->cap = cap;
+    }
+    memcpy(d->b+d->n,p,size);
+    d->n += size;
+    return 0;
+}
+
+/*
+** bytecode cache for source sections, off unless PLUA_CACHE names a
+** directory or plua.cache sets one. Entries are luaU_dump output named
+** after the section's contents and the VM stamp, written under a
+** temporary name and renamed into place so concurrent writers are safe;
+** a hit touches the file, and the oldest ones go once the directory
+** holds more than the size limit. The directory is only scanned on the
+** first store of a state and when the bytes stored since then take its
+** running total past the limit; eviction leaves a quarter of the limit
+** free so that does not happen on every store
+*/
+#define LUA_PLUACACHE		"PLUACACHE*"
+#define CACHELIMIT	(64<<20)
+#define CACHEEXT	".plc"
+
+typedef struct{
+    BYTE stamp[sizeof(bcstamp)];
+    uint32_t crc;   /* CRC32C of the dump */
+    uint32_t size;
+} CACHEHEAD;
+
+/* cache directory of this state, or NULL; the registry holds the string */
+static const char *cachedir(lua_State *L, size_t *limit){
+    const char *dir = NULL;
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_PLUACACHE);
+    if(lua_isnil(L,-1)){  /* first use: take the environment's */
+        lua_pop(L,1);
+        lua_createtable(L,0,2);
+        if(getenv("PLUA_CACHE") != NULL && *getenv("PLUA_CACHE") != '\0'){
+            lua_pushstring(L,getenv("PLUA_CACHE"));
+            lua_setfield(L,-2,"dir");
+        }
+        lua_pushinteger(L,CACHELIMIT);
+        lua_setfield(L,-2,"limit");
+        lua_pushvalue(L,-1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_PLUACACHE);
+    }
+    lua_getfield(L,-1,"limit");
+    *limit = lua_tointeger(L,-1);
+    lua_getfield(L,-2,"dir");
+    dir = lua_tostring(L,-1);
+    lua_pop(L,3);
+    return dir;
+}
+
+static void cachepath(char *path, size_t size, const char *dir, const char *key){
+    snprintf(path,size,"%s/%s" CACHEEXT,dir,key);
+}
+
+/* name of the entry for section i: FNV-1a 64 and CRC32C of its stored bytes, its size, the VM stamp */
+static int cachekey(CORE_HANDLE *ch, unsigned int i, char *key){
+    unsigned int off = choff(ch,i), left = ch->heads[i].size;
+    uint64_t h = 14695981039346656037ull, stamp = 0;
+    uint32_t crc = 0;
+    const uint8_t *p = chptr(ch,off,left);
+    uint8_t *buf = NULL;
+    while(left > 0){
+        size_t k = left;
+        if(p == NULL){
+            if(buf == NULL && (buf = malloc(ZBLOCK)) == NULL) return 0;
+            if((k = chread(ch,buf,off,(left < ZBLOCK) ? left : ZBLOCK)) == 0) break;
+        }
+        const uint8_t *b = (p != NULL) ? p : buf;
+        for(size_t j = 0;j<k;j++) h = (h ^ b[j]) * 1099511628211ull;
+        crc = crc32c(crc,b,k);
+        off += k;
+        left -= k;
+    }
+    free(buf);
+    if(left > 0) return 0;
+    for(size_t j = 0;j<sizeof(bcstamp);j++) stamp = (stamp << 8) | bcstamp[j];
+    snprintf(key,CACHEKEY,"%016llx%08x%08x-%016llx",(unsigned long long)h,crc,ch->heads[i].size,(unsigned long long)stamp);
+    return 1;
+}
+
+/*
+** push the cached function for section i and return 1; on a miss return 0
+** and fill key (left empty when there is no cache) for cachestore
+*/
+static int cacheload(lua_State *L, CORE_HANDLE *ch, unsigned int i, char *key){
+    char path[FILENAME_MAX];
+    CACHEHEAD hd;
+    size_t limit;
+    const char *dir = cachedir(L,&limit);
+    uint8_t *b;
+    FILE *f;
+    int ok = 0;
+    if(dir == NULL || !cachekey(ch,i,key)){
+        key[0] = '\0';
+        return 0;
+    }
+    cachepath(path,sizeof(path),dir,key);
+    if((f = fopen(path,"rb")) == NULL) return 0;
+    if(fread(&hd,sizeof(hd),1,f) == 1 && memcmp(hd.stamp,bcstamp,sizeof(bcstamp)) == 0
+       && flength(f) == (long)(sizeof(hd)+hd.size) && (b = malloc(hd.size+1)) != NULL){
+        if(fread(b,1,hd.size,f) == hd.size && crc32c(0,b,hd.size) == hd.crc){
+            if(luaL_loadbuffer(L,(const char *)b,hd.size,"=") == 0) ok = 1;
+            else lua_pop(L,1);  /* unusable: compile again and replace it */
+        }
+        free(b);
+    }
+    fclose(f);
+    if(ok) utime(path,NULL);  /* most recently used */
+    return ok;
+}
+
+/* size of the entries in dir, dropping the least recently used ones if it passes limit */
+static uint64_t cacheevict(const char *dir, size_t limit){
+    struct{
+        char name[FILENAME_MAX];
+        uint64_t size, mtime;
+    } *e = NULL, t;
+    size_t n = 0, cap = 0;
+    uint64_t total = 0;
+#if defined(_WIN32)
+    WIN32_FIND_DATAA fd;
+    char pat[FILENAME_MAX];
+    snprintf(pat,sizeof(pat),"%s/*" CACHEEXT,dir);
+    HANDLE h = FindFirstFileA(pat,&fd);
+    if(h == INVALID_HANDLE_VALUE) return 0;
+    do{
+        if(n == cap){
+            void *p = realloc(e,sizeof(*e)*(cap = cap ? cap*2 : 64));
+            if(p == NULL) break;
+            e = p;
+        }
+        snprintf(e[n].name,sizeof(e[n].name),"%s/%s",dir,fd.cFileName);
+        e[n].size = ((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+        e[n].mtime = ((uint64_t)fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime;
+        total += e[n++].size;
+    }while(FindNextFileA(h,&fd));
+    FindClose(h);
+#else
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    struct stat st;
+    if(d == NULL) return 0;
+    while((de = readdir(d)) != NULL){
+        size_t len = strlen(de->d_name);
+        if(len <= strlen(CACHEEXT) || strcmp(de->d_name+len-strlen(CACHEEXT),CACHEEXT) != 0) continue;
+        if(n == cap){
+            void *p = realloc(e,sizeof(*e)*(cap = cap ? cap*2 : 64));
+            if(p == NULL) break;
+            e = p;
+        }
+        snprintf(e[n].name,sizeof(e[n].name),"%s/%s",dir,de->d_name);
+        if(stat(e[n].name,&st) != 0) continue;
+        e[n].size = st.st_size;
+        e[n].mtime = st.st_mtime;
+        total += e[n++].size;
+    }
+    closedir(d);
+#endif
+    if(total > limit){
+        for(size_t a = 1;a<n;a++){  /* oldest first */
+            size_t b = a;
+            t = e[a];
+            for(;b > 0 && e[b-1].mtime > t.mtime;b--) e[b] = e[b-1];
+            e[b] = t;
+        }
+        for(size_t a = 0;a<n && total > limit-limit/4;a++)
+            if(remove(e[a].name) == 0) total -= e[a].size;
+    }
+    free(e);
+    return total;
+}
+
+/* store the luaU_dump output of the function on top of the stack under key */
+static void cachestore(lua_State *L, const char *key){
+    static unsigned int seq;
+    char path[FILENAME_MAX], tmp[FILENAME_MAX+64];
+    CACHEHEAD hd;
+    DUMPBUF d = {NULL,0,0};
+    size_t limit;
+    const char *dir = cachedir(L,&limit);
+    lua_Number used;
+    FILE *f;
+    int ok;
+    if(dir == NULL || lua_dump(L,dumpwriter,&d) != 0 || d.n > 0xFFFFFFFFu){
+        free(d.b);
+        return;
+    }
+    memcpy(hd.stamp,bcstamp,sizeof(bcstamp));
+    hd.crc = crc32c(0,d.b,d.n);
+    hd.size = d.n;
+    cachepath(path,sizeof(path),dir,key);
+#if defined(_WIN32)
+    snprintf(tmp,sizeof(tmp),"%s.%lu.%u.tmp",path,(unsigned long)GetCurrentProcessId(),__sync_fetch_and_add(&seq,1));
+#else
+    snprintf(tmp,sizeof(tmp),"%s.%lu.%u.tmp",path,(unsigned long)getpid(),__sync_fetch_and_add(&seq,1));
+#endif
+    if((f = fopen(tmp,"wb")) == NULL){
+        free(d.b);
+        return;
+    }
+    ok = fwrite(&hd,sizeof(hd),1,f) == 1 && fwrite(d.b,1,d.n,f) == d.n;
+    ok = (fclose(f) == 0) && ok;
+    free(d.b);
+#if defined(_WIN32)
+    ok = ok && MoveFileExA(tmp,path,MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp,path) == 0;
+#endif
+    if(!ok){
+        remove(tmp);
+        return;
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_PLUACACHE);
+    lua_getfield(L,-1,"used");
+    used = lua_tonumber(L,-1)+sizeof(hd)+hd.size;
+    if(lua_isnil(L,-1) || used > limit) used = (lua_Number)cacheevict(dir,limit);
+    lua_pushnumber(L,used);
+    lua_setfield(L,-3,"used");
+    lua_pop(L,2);
+}
+
+/* plua.cache([dir[, limit]]): where source sections keep their bytecode; no dir turns it off */
+static int plua_cache(lua_State *L){
+    lua_createtable(L,0,2);
+    if(!lua_isnoneornil(L,1)){
+        luaL_checkstring(L,1);
+        lua_pushvalue(L,1);
+        lua_setfield(L,-2,"dir");
+    }
+    lua_pushinteger(L,luaL_optinteger(L,2,CACHELIMIT));
+    lua_setfield(L,-2,"limit");
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_PLUACACHE);
+    return 0;
+}
+
+#define LUA_PLUAARRAY		"PLUAARRAY*"
+
+/* packed numeric array made by freadarray: doubles (t 2) or ints (t 3) */
+typedef struct{
+    size_t n;
+    unsigned int t;
+    union{
+        double d[1];
+        int i[1];
+    } v;
+} PARRAY;
+
+#define toarray(L,i)	((PARRAY *)luaL_checkudata(L, i, LUA_PLUAARRAY))
+
+/* freadarray(n, t, c): like fread, but into a packed array userdata */
+static int fplua_freadarray(lua_State *L){
+    CORE_HANDLE **ch = tochp(L);
+    unsigned int n = luaL_checknumber(L, 2);
+    unsigned int t = luaL_checknumber(L, 3);
+    size_t c = luaL_checknumber(L, 4);
+    if(*ch == NULL) closed(L);
+    luaL_argcheck(L, t == 2 || t == 3, 3, "packed arrays hold doubles (2) or ints (3)");
+    if(n == 0 || n > (*ch)->chead.nofsec) return 0;
+    size_t es = esize(t,0);
+    if(c > (((size_t)-1)-sizeof(PARRAY))/es) luaL_error(L,"too many elements");
+    size_t size = c*es;
+    uint8_t *copy;
+    const uint8_t *p = secrange(*ch,n-1,&size,&copy);
+    if(p == NULL) return 0;
+    c = size/es;
+    PARRAY *a = (PARRAY *)lua_newuserdata(L,offsetof(PARRAY,v)+(c ? c : 1)*es);
+    a->n = c;
+    a->t = t;
+    memcpy(&a->v,p,c*es);
+    free(copy);
+    luaL_getmetatable(L, LUA_PLUAARRAY);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int array_index(lua_State *L){
+    PARRAY *a = toarray(L,1);
+    if(lua_type(L,2) == LUA_TNUMBER){
+        lua_Integer i = lua_tointeger(L,2);
+        if(i < 1 || (size_t)i > a->n) return 0;
+        if(a->t == 2) lua_pushnumber(L,a->v.d[i-1]);
+        else lua_pushinteger(L,a->v.i[i-1]);
+        return 1;
+    }
+    lua_getmetatable(L,1);  /* methods live in the metatable */
+    lua_pushvalue(L,2);
+    lua_rawget(L,-2);
+    return 1;
+}
+
+static int array_newindex(lua_State *L){
+    PARRAY *a = toarray(L,1);
+    lua_Integer i = luaL_checkinteger(L,2);
+    luaL_argcheck(L, i >= 1 && (size_t)i <= a->n, 2, "index out of range");
+    if(a->t == 2) a->v.d[i-1] = luaL_checknumber(L,3);
+    else a->v.i[i-1] = luaL_checkinteger(L,3);
+    return 0;
+}
+
+static int array_len(lua_State *L){
+    lua_pushinteger(L,toarray(L,1)->n);
+    return 1;
+}
+
+static int array_totable(lua_State *L){
+    PARRAY *a = toarray(L,1);
+    lua_createtable(L,a->n,0);
+    for(size_t i = 0;i<a->n;i++){
+        if(a->t == 2) lua_pushnumber(L,a->v.d[i]);
+        else lua_pushinteger(L,a->v.i[i]);
+        lua_rawseti(L,-2,i+1);
+    }
+    return 1;
+}
+
+static const luaL_Reg arraylib[] = {
+  {"len",           array_len},
+  {"totable",       array_totable},
+  {"__index",       array_index},
+  {"__newindex",    array_newindex},
+  {"__len",         array_len},
+  {NULL, NULL}
+};
+
+#define LUA_PLUASTRUCT		"PLUASTRUCT*"
+
+/*
+** record layouts for pack/unpack, written like string.pack formats:
+** < > = byte order, ![n] max alignment, b B h H l L, i[n] I[n] (n <= 8),
+** f d n, c<n> fixed string, z zero-terminated string, s[n] string with
+** an n-byte length prefix (default 4), x one padding byte
+*/
+typedef struct{
+    char op;        /* 'i' signed, 'u' unsigned, 'f', 'd', 'n', 'c', 'z', 's', 'x' */
+    BYTE size;      /* bytes of the value, or of the length prefix for 's' */
+    BYTE little;
+    BYTE align;     /* alignment from the record start, 1 for none */
+    size_t len;     /* 'c': string length */
+} SITEM;
+
+typedef struct{
+    unsigned int n;      /* items */
+    unsigned int nvals;  /* values a record holds */
+    size_t fixed;        /* bytes per record, 0 if z or s make it vary */
+    SITEM item[1];
+} SDESC;
+
+#define tostruct(L,i)	((SDESC *)luaL_checkudata(L, i, LUA_PLUASTRUCT))
+
+static size_t fmtnum(const char **fmt, size_t df){
+    size_t a = 0;
+    if(!isdigit((unsigned char)**fmt)) return df;
+    while(isdigit((unsigned char)**fmt) && a <= (INT_MAX-9)/10) a = a*10 + (*(*fmt)++ - '0');
+    return a;
+}
+
+/* size n of i[n] I[n] s[n], checked before it is narrowed to a BYTE */
+static BYTE fmtsize(lua_State *L, const char **fmt){
+    size_t n = fmtnum(fmt,4);
+    if(n < 1 || n > 8) luaL_error(L,"integral size (%d) out of limits [1,8]",(int)n);
+    return (BYTE)n;
+}
+
+/* compile fmt into a descriptor userdata left on the stack */
+static SDESC *scompile(lua_State *L, const char *fmt){
+    size_t len = strlen(fmt);
+    SDESC *d = (SDESC *)lua_newuserdata(L,offsetof(SDESC,item)+(len+1)*sizeof(SITEM));
+    BYTE little = !IS_BIG_ENDIAN, maxalign = 1;
+    size_t pos = 0;
+    int variable = 0;
+    d->n = d->nvals = 0;
+    while(*fmt){
+        SITEM *it = &d->item[d->n];
+        char c = *fmt++;
+        it->little = little;
+        it->len = 0;
+        switch(c){
+            case ' ': continue;
+            case '<': little = 1; continue;
+            case '>': little = 0; continue;
+            case '=': little = !IS_BIG_ENDIAN; continue;
+            case '!':{
+                size_t a = fmtnum(&fmt,8);
+                if(a < 1 || a > 16) luaL_error(L,"alignment (%d) out of limits [1,16]",(int)a);
+                if((a & (a-1)) != 0) luaL_error(L,"format asks for alignment not power of 2");
+                maxalign = (BYTE)a;
+                continue;
+            }
+            case 'b': it->op = 'i'; it->size = 1; break;
+            case 'B': it->op = 'u'; it->size = 1; break;
+            case 'h': it->op = 'i'; it->size = 2; break;
+            case 'H': it->op = 'u'; it->size = 2; break;
+            case 'l': it->op = 'i'; it->size = 8; break;
+            case 'L': it->op = 'u'; it->size = 8; break;
+            case 'i': it->op = 'i'; it->size = fmtsize(L,&fmt); break;
+            case 'I': it->op = 'u'; it->size = fmtsize(L,&fmt); break;
+            case 'f': it->op = 'f'; it->size = sizeof(float); break;
+            case 'd': it->op = 'd'; it->size = sizeof(double); break;
+            case 'n': it->op = 'n'; it->size = sizeof(lua_Number); break;
+            case 'x': it->op = 'x'; it->size = 1; break;
+            case 'z': it->op = 'z'; it->size = 1; variable = 1; break;
+            case 's': it->op = 's'; it->size = fmtsize(L,&fmt); variable = 1; break;
+            case 'c':
+                it->op = 'c';
+                it->size = 1;
+                if(!isdigit((unsigned char)*fmt)) luaL_error(L,"missing size for format option 'c'");
+                it->len = fmtnum(&fmt,0);
+                break;
+            default: luaL_error(L,"invalid format option '%c'",c);
+        }
+        it->align = 1;
+        if(it->op != 'c' && it->op != 'z' && it->op != 'x'){
+            BYTE a = (it->size < maxalign) ? it->size : maxalign;
+            if((a & (a-1)) != 0) luaL_error(L,"format asks for alignment not power of 2");
+            it->align = a;
+        }
+        pos += (it->align - (pos % it->align)) % it->align;
+        pos += (it->op == 'c') ? it->len : it->size;
+        if(it->op != 'x') d->nvals++;
+        d->n++;
+    }
+    d->fixed = variable ? 0 : pos;
+    luaL_getmetatable(L, LUA_PLUASTRUCT);
+    lua_setmetatable(L, -2);
+    return d;
+}
+
+/*
+** descriptor for the format or descriptor at index i; compiled formats are
+** kept in a weak cache in the registry so loops do not parse them again
+*/
+static SDESC *getdesc(lua_State *L, int i){
+    SDESC *d;
+    if(lua_type(L,i) == LUA_TUSERDATA) return tostruct(L,i);
+    luaL_checkstring(L,i);
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_PLUASTRUCT);
+    if(lua_isnil(L,-1)){
+        lua_pop(L,1);
+        lua_newtable(L);
+        lua_createtable(L,0,1);
+        lua_pushliteral(L,"v");
+        lua_setfield(L,-2,"__mode");
+        lua_setmetatable(L,-2);
+        lua_pushvalue(L,-1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_PLUASTRUCT);
+    }
+    lua_pushvalue(L,i);
+    lua_rawget(L,-2);
+    if((d = (SDESC *)lua_touserdata(L,-1)) == NULL){
+        lua_pop(L,1);
+        d = scompile(L,lua_tostring(L,i));
+        lua_pushvalue(L,i);
+        lua_pushvalue(L,-2);
+        lua_rawset(L,-4);
+    }
+    lua_replace(L,i);  /* keeps the descriptor alive for the call */
+    lua_pop(L,1);
+    return d;
+}
+
+static void putuint(uint8_t *b, uint64_t v, int size, int little){
+    for(int k = 0;k<size;k++){
+        b[little ? k : size-1-k] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+static uint64_t getuint(const uint8_t *b, int size, int little){
+    uint64_t v = 0;
+    for(int k = size-1;k>=0;k--) v = (v << 8) | b[little ? k : size-1-k];
+    return v;
+}
+
+/* append one record made of the values from index arg on */
+static void spack(lua_State *L, SDESC *d, int arg, DUMPBUF *out){
+    static const uint8_t zeros[8] = {0};
+    size_t start = out->n;
+    int failed = 0;
+    for(unsigned int k = 0;k<d->n;k++){
+        SITEM *it = &d->item[k];
+        uint8_t b[8];
+        size_t pad = (it->align - ((out->n-start) % it->align)) % it->align;
+        failed |= dumpwriter(L,zeros,pad,out);
+        switch(it->op){
+            case 'i': case 'u':{
+                lua_Number v = luaL_checknumber(L,arg);
+                /* the conversions are undefined outside the 64-bit range */
+                luaL_argcheck(L, v >= -9223372036854775808.0 &&
+                    v < ((it->op == 'i') ? 9223372036854775808.0 : 18446744073709551616.0), arg, "integer overflow");
+                putuint(b,(v < 0) ? (uint64_t)(int64_t)v : (uint64_t)v,it->size,it->little);
+                arg++;
+                failed |= dumpwriter(L,b,it->size,out);
+                break;
+            }
+            case 'f':{
+                float f = (float)luaL_checknumber(L,arg++);
+                uint32_t u;
+                memcpy(&u,&f,sizeof(u));
+                putuint(b,u,sizeof(u),it->little);
+                failed |= dumpwriter(L,b,sizeof(u),out);
+                break;
+            }
+            case 'd': case 'n':{
+                double f = (double)luaL_checknumber(L,arg++);
+                uint64_t u;
+                memcpy(&u,&f,sizeof(u));
+                putuint(b,u,sizeof(u),it->little);
+                failed |= dumpwriter(L,b,sizeof(u),out);
+                break;
+            }
+            case 'c':{
+                size_t l;
+                const char *str = luaL_checklstring(L,arg++,&l);
+                luaL_argcheck(L, l <= it->len, arg-1, "string longer than given size");
+                failed |= dumpwriter(L,str,l,out);
+                for(;l<it->len;l++) failed |= dumpwriter(L,zeros,1,out);
+                break;
+            }
+            case 'z':{
+                size_t l;
+                const char *str = luaL_checklstring(L,arg++,&l);
+                luaL_argcheck(L, strlen(str) == l, arg-1, "string contains zeros");
+                failed |= dumpwriter(L,str,l+1,out);
+                break;
+            }
+            case 's':{
+                size_t l;
+                const char *str = luaL_checklstring(L,arg++,&l);
+                luaL_argcheck(L, it->size >= 8 || l < ((uint64_t)1 << (it->size*8)), arg-1, "string length does not fit in given size");
+                putuint(b,l,it->size,it->little);
+                failed |= dumpwriter(L,b,it->size,out);
+                failed |= dumpwriter(L,str,l,out);
+                break;
+            }
+            case 'x':
+                failed |= dumpwriter(L,zeros,1,out);
+                break;
+        }
+    }
+    if(failed){
+        free(out->b);
+        out->b = NULL;
+        luaL_error(L,"not enough memory");
+    }
+}
+
+/* push the values of the record at p[*pos]; 0 (nothing pushed) if it does not fit */
+static int sunpack(lua_State *L, SDESC *d, const uint8_t *p, size_t len, size_t *pos){
+    size_t at = *pos;
+    int top = lua_gettop(L);
+    luaL_checkstack(L,d->nvals,"too many results");
+    for(unsigned int k = 0;k<d->n;k++){
+        SITEM *it = &d->item[k];
+        size_t need;
+        at += (it->align - ((at-*pos) % it->align)) % it->align;
+        need = (it->op == 'c') ? it->len : it->size;
+        if(at > len || need > len-at) goto short_data;
+        switch(it->op){
+            case 'i':{
+                uint64_t u = getuint(p+at,it->size,it->little);
+                if(it->size < 8 && (u >> (it->size*8-1))) u |= ~(uint64_t)0 << (it->size*8);
+                lua_pushnumber(L,(lua_Number)(int64_t)u);
+                break;
+            }
+            case 'u':
+                lua_pushnumber(L,(lua_Number)getuint(p+at,it->size,it->little));
+                break;
+            case 'f':{
+                uint32_t u = (uint32_t)getuint(p+at,sizeof(u),it->little);
+                float f;
+                memcpy(&f,&u,sizeof(f));
+                lua_pushnumber(L,f);
+                break;
+            }
+            case 'd': case 'n':{
+                uint64_t u = getuint(p+at,sizeof(u),it->little);
+                double f;
+                memcpy(&f,&u,sizeof(f));
+                lua_pushnumber(L,f);
+                break;
+            }
+            case 'c':
+                lua_pushlstring(L,(const char *)p+at,it->len);
+                break;
+            case 'z':{
+                const uint8_t *e = memchr(p+at,0,len-at);
+                if(e == NULL) goto short_data;
+                lua_pushlstring(L,(const char *)p+at,e-(p+at));
+                need = e-(p+at)+1;
+                break;
+            }
+            case 's':{
+                uint64_t l = getuint(p+at,it->size,it->little);
+                if(l > len-at-it->size) goto short_data;
+                lua_pushlstring(L,(const char *)p+at+it->size,l);
+                need += l;
+                break;
+            }
+        }
+        at += need;
+    }
+    *pos = at;
+    return 1;
+short_data:
+    lua_settop(L,top);
+    return 0;
+}
+
+static int struct_size(lua_State *L){
+    SDESC *d = tostruct(L,1);
+    if(d->fixed == 0 && d->n > 0) return 0;
+    lua_pushinteger(L,d->fixed);
+    return 1;
+}
+
+/* desc:pack(...) -> string */
+static int struct_pack(lua_State *L){
+    SDESC *d = tostruct(L,1);
+    DUMPBUF out = {NULL,0,0};
+    spack(L,d,2,&out);
+    lua_pushlstring(L,(const char *)out.b,out.n);
+    free(out.b);
+    return 1;
+}
+
+/* desc:unpack(string or view[, pos]) -> values..., next pos */
+static int struct_unpack(lua_State *L){
+    SDESC *d = tostruct(L,1);
+    const uint8_t *p;
+    size_t len;
+    if(lua_type(L,2) == LUA_TUSERDATA){
+        VIEW *v = toview(L,2);
+        p = v->p;
+        len = v->len;
+    }else{
+        p = (const uint8_t *)luaL_checklstring(L,2,&len);
+    }
+    size_t pos = vpos(luaL_optinteger(L,3,1),len);
+    luaL_argcheck(L, pos >= 1 && pos <= len+1, 3, "initial position out of string");
+    pos--;
+    if(!sunpack(L,d,p,len,&pos)) luaL_error(L,"data string too short");
+    lua_pushinteger(L,pos+1);
+    return d->nvals+1;
+}
+
+static int plua_struct(lua_State *L){
+    getdesc(L,1);
+    lua_settop(L,1);
+    return 1;
+}
+
+static const luaL_Reg structlib[] = {
+  {"size",          struct_size},
+  {"pack",          struct_pack},
+  {"unpack",        struct_unpack},
+  {NULL, NULL}
+};
+
+/* write len bytes at the fseek position of section i, which they must fit in */
+static void secwrite(lua_State *L, CORE_HANDLE *ch, unsigned int i, const uint8_t *p, size_t len){
+    unsigned int pos = ch->pos[i];
+    if(ch->_io == 0){
+        if(!chsec(ch,i)) luaL_error(L,"section %d is corrupted",i+1);
+        if(ch->heads[i].Characteristics & 0x40) luaL_error(L,"cannot write to compressed section %d",i+1);
+    }
+    if(pos > ch->heads[i].size || len > ch->heads[i].size-pos)
+        luaL_error(L,"record does not fit in section %d",i+1);
+    if(ch->_io == 0){
+        chlock(ch);
+        fseek(ch->f,choff(ch,i)+pos,SEEK_SET);
+        fwrite(p,1,len,ch->f);
+        fflush(ch->f); /* keep the mapping coherent */
+        chunlock(ch);
+        chrecrc(ch,i);
+    }else if(ch->wtype[i] == 1){
+        memcpy(ch->data[i].data+pos,p,len);
+    }else if(ch->wtype[i] == 2){
+        FILE *f = fopen(ch->data[i].filename,"r+b");
+        if(f != NULL){
+            fseek(f,pos,SEEK_SET);
+            fwrite(p,1,len,f);
+            fclose(f);
+        }
+    }else{
+        luaL_error(L,"section %d has no contents",i+1);
+    }
+}
+
+static unsigned int secarg(lua_State *L, CORE_HANDLE **ch){
+    unsigned int n = luaL_checkinteger(L, 2);
+    if(*ch == NULL) closed(L);
+    luaL_argcheck(L, n > 0 && n <= (*ch)->chead.nofsec, 2, "no such section");
+    return n-1;
+}
+
+/*
+** h:update(n, data[, characteristics]) replaces the contents of section n
+** (and of its aliases) by appending data and a new journal to the bundle,
+** so the cost follows the size of data rather than that of the bundle.
+** The characteristics default to the old ones, with 0x20 following data.
+*/
+static int fplua_update(lua_State *L){
+    CORE_HANDLE **chp = tochp(L);
+    unsigned int i = secarg(L,chp), n, cnt, off, at;
+    CORE_HANDLE *ch = *chp;
+    size_t len;
+    const char *data = luaL_checklstring(L,3,&len);
+    BYTE c;
+    JENTRY *jl;
+    uint32_t crc;
+    int ok;
+    if(ch->_io != 0) luaL_error(L,"not a loaded bundle");
+    if(ch->ver != BUNDLEVER) luaL_error(L,"legacy bundles cannot be updated");
+    if(!chsec(ch,i)) luaL_error(L,"section %d is corrupted",i+1);
+    c = ch->heads[i].Characteristics & ~(0x20|0x40);
+    if(len >= sizeof(bcstamp) && memcmp(data,bcstamp,sizeof(bcstamp)) == 0) c |= 0x20;
+    c = (BYTE)luaL_optinteger(L,4,c);
+    crc = crc32c(0,data,len);
+    n = ch->chead.nofsec;
+    chlock(ch);
+    if(!chedit(ch) || (ch->offsets = chunshare(ch,ch->offsets,sizeof(uint32_t)*(n+1))) == NULL
+       || (ch->crc != NULL && (ch->crc = chunshare(ch,ch->crc,sizeof(uint32_t)*n)) == NULL)
+       || (jl = malloc(sizeof(JENTRY)*(ch->njournal+n)+1)) == NULL){
+        chunlock(ch);
+        luaL_error(L,"not enough memory");
+    }
+    /* the new journal: the old one with section i and its aliases replaced or added */
+    cnt = ch->njournal;
+    if(cnt > 0) memcpy(jl,ch->journal,sizeof(JENTRY)*cnt);
+    off = ch->end-ch->Coffset;
+    for(unsigned int k = 0;k<n;k++){
+        unsigned int e = 0;
+        if(k != i && (ch->offsets[k] != ch->offsets[i] || ch->heads[k].size != ch->heads[i].size)) continue;
+        while(e < cnt && jl[e].sec != k) e++;
+        if(e == cnt) cnt++;
+        jl[e].sec = k;
+        jl[e].offset = off;
+        jl[e].size = len;
+        jl[e].crc = crc;
+        jl[e].Characteristics = c;
+    }
+    if((uint64_t)ch->end+len+sizeof(JOURNAL)+sizeof(JENTRY)*cnt+sizeof(TRAILER) > 0xFFFFFFFFu){
+        chunlock(ch);
+        free(jl);
+        luaL_error(L,"bundle would exceed 4 GiB");
+    }
+    at = ch->end+len;
+    fseek(ch->f,ch->end,SEEK_SET);
+    ok = fwrite(data,1,len,ch->f) == len && fflush(ch->f) == 0 && chjwrite(ch,at,jl,cnt);
+    if(ok){
+        free(ch->journal);
+        ch->journal = jl;
+        ch->njournal = cnt;
+        ch->jat = at;
+        ch->end = at+sizeof(JOURNAL)+sizeof(JENTRY)*cnt+sizeof(TRAILER);
+        for(unsigned int e = 0;e<cnt;e++){
+            if(jl[e].offset != off) continue;
+            chapply(ch,&jl[e]);
+            ch->pos[jl[e].sec] = 0;
+            if(ch->verified != NULL) bitset(ch->verified,jl[e].sec);
+        }
+    }else{
+        free(jl);
+    }
+    chunlock(ch);
+    if(!ok) luaL_error(L,"cannot write bundle");
+    return 0;
+}
+
+/* h:pack(n, fmt, ...) writes one record at the fseek position; returns the position after it */
+static int fplua_pack(lua_State *L){
+    CORE_HANDLE **ch = tochp(L);
+    unsigned int i = secarg(L,ch);
+    SDESC *d = getdesc(L,3);
+    DUMPBUF out = {NULL,0,0};
+    spack(L,d,4,&out);
+    if(out.n > 0) secwrite(L,*ch,i,out.b,out.n);
+    free(out.b);
+    lua_pushinteger(L,(*ch)->pos[i]+out.n);
+    return 1;
+}
+
+/* h:packrecords(n, fmt, {{...}, ...}) writes every record with a single write */
+static int fplua_packrecords(lua_State *L){
+    CORE_HANDLE **ch = tochp(L);
+    unsigned int i = secarg(L,ch);
+    SDESC *d = getdesc(L,3);
+    DUMPBUF out = {NULL,0,0};
+    int count;
+    luaL_checktype(L,4,LUA_TTABLE);
+    count = lua_objlen(L,4);
+    for(int r = 1;r<=count;r++){
+        int top = lua_gettop(L);
+        lua_rawgeti(L,4,r);
+        if(!lua_istable(L,-1)){
+            free(out.b);
+            luaL_error(L,"record %d is not a table",r);
+        }
+        luaL_checkstack(L,d->nvals,"record too large");
+        for(unsigned int k = 1;k<=d->nvals;k++) lua_rawgeti(L,top+1,k);
+        spack(L,d,top+2,&out);
+        lua_settop(L,top);
+    }
+    if(out.n > 0) secwrite(L,*ch,i,out.b,out.n);
+    free(out.b);
+    lua_pushinteger(L,(*ch)->pos[i]+out.n);
+    return 1;
+}
+
+/* h:unpack(n, fmt) -> values..., position after the record */
+static int fplua_unpack(lua_State *L){
+    CORE_HANDLE **ch = tochp(L);
+    unsigned int i = secarg(L,ch);
+    SDESC *d = getdesc(L,3);
+    size_t size = d->fixed ? d->fixed : (size_t)-1, pos = 0;
+    uint8_t *copy;
+    const uint8_t *p = secrange(*ch,i,&size,&copy);
+    if(p == NULL) return 0;
+    int ok = sunpack(L,d,p,size,&pos);
+    free(copy);
+    if(!ok) return 0;
+    lua_pushinteger(L,(*ch)->pos[i]+pos);
+    return d->nvals+1;
+}
+
+/* h:unpackrecords(n, fmt[, count]) -> {{...}, ...}, position after the last one */
+static int fplua_unpackrecords(lua_State *L){
+    CORE_HANDLE **ch = tochp(L);
+    unsigned int i = secarg(L,ch);
+    SDESC *d = getdesc(L,3);
+    size_t count = luaL_optinteger(L,4,0), size = (size_t)-1, pos = 0;
+    uint8_t *copy;
+    if(d->fixed && count > 0 && count <= ((size_t)-1)/d->fixed) size = count*d->fixed;
+    const uint8_t *p = secrange(*ch,i,&size,&copy);
+    if(p == NULL) return 0;
+    if(d->fixed) lua_createtable(L,(count > 0 && count < size/d->fixed) ? count : size/d->fixed,0);
+    else lua_newtable(L);
+    for(size_t r = 1;(count == 0 || r <= count) && pos < size;r++){
+        int top = lua_gettop(L);
+        if(!sunpack(L,d,p,size,&pos)) break;
+        lua_createtable(L,d->nvals,0);
+        for(int k = d->nvals;k>=1;k--){
+            lua_pushvalue(L,top+k);
+            lua_rawseti(L,-2,k);
+        }
+        lua_rawseti(L,top,r);
+        lua_settop(L,top);
+    }
+    free(copy);
+    lua_pushinteger(L,(*ch)->pos[i]+pos);
+    return 2;
+}
+
 static int plua_llib(lua_State *L){
-    CORE_HANDLE *Old_ch;
-    Old_ch = C_ch;
-    C_ch = g_ch;
-    if(C_ch != NULL){
+    if(g_ch != NULL){
     const char *name = luaL_checkstring(L, 1);
     const char *init = luaL_checkstring(L, 2);
-    int status = llib(L,name,init,0);
-    C_ch = Old_ch;
-    return status;
+    return llib(L,g_ch,name,init,0);
     }
 	return 0;
 }
 
 static int fplua_llib(lua_State *L){
-    CORE_HANDLE *Old_ch;
-    Old_ch = C_ch;
     CORE_HANDLE **ch = tochp(L);
-    C_ch = *ch;
-    if(C_ch != NULL){
+    if(*ch != NULL){
     const char *name = luaL_checkstring(L, 2);
     const char *init = luaL_checkstring(L, 3);
-    int status = llib(L,name,init,0);
-    C_ch = Old_ch;
-    return status;
+    return llib(L,*ch,name,init,0);
     }
 	return 0;
 }
@@ -1032,63 +3514,20 @@ static int fplua_fwrite(lua_State *L){
             if(n > 0 && n < (*ch)->chead.nofsec+1){
                     switch (t)
                     {
-                        case 1:
-                            {
+                        case 1:{
                                 size_t si;
                                 const char *data = luaL_checklstring (L,4,&si);
-                                if((*ch)->_io){
-                                    if((*ch)->wtype[n-1] == 1){
-                                        memcpy((*ch)->data[n-1].data+(*ch)->pos[n-1],data,si);
-                                    }else if((*ch)->wtype[n-1] == 2){
-                                        FILE *f = fopen((*ch)->data[n-1].filename,"r+b");
-                                        if(f != NULL){
-                                            fseek(f,(*ch)->pos[n-1],SEEK_SET);
-                                            fwrite(data,si,1,f);
-                                            fclose(f);
-                                        }
-                                    }
-                                }else{
-                                    fseek((*ch)->f,(*ch)->offsets[n-1]+(*ch)->pos[n-1],SEEK_SET);
-                                    fwrite(data,si,1,(*ch)->f);
-                                }
+                                secwrite(L,*ch,n-1,(const uint8_t *)data,si);
                             }
                             break;
                         case 2:{
                                 double data = luaL_checknumber(L,4);
-                                if((*ch)->_io){
-                                    if((*ch)->wtype[n-1] == 1){
-                                        memcpy((*ch)->data[n-1].data+(*ch)->pos[n-1],&data,sizeof(double));
-                                    }else if((*ch)->wtype[n-1] == 2){
-                                        FILE *f = fopen((*ch)->data[n-1].filename,"r+b");
-                                        if(f != NULL){
-                                            fseek(f,(*ch)->pos[n-1],SEEK_SET);
-                                            fwrite(&data,sizeof(double),1,f);
-                                            fclose(f);
-                                        }
-                                    }
-                                }else{
-                                    fseek((*ch)->f,(*ch)->offsets[n-1]+(*ch)->pos[n-1],SEEK_SET);
-                                    fwrite(&data,sizeof(double),1,(*ch)->f);
-                                }
+                                secwrite(L,*ch,n-1,(const uint8_t *)&data,sizeof(double));
                             }
                             break;
                         case 3:{
                                 int data = luaL_checknumber(L,4);
-                                if((*ch)->_io){
-                                    if((*ch)->wtype[n-1] == 1){
-                                        memcpy((*ch)->data[n-1].data+(*ch)->pos[n-1],&data,sizeof(int));
-                                    }else if((*ch)->wtype[n-1] == 2){
-                                        FILE *f = fopen((*ch)->data[n-1].filename,"r+b");
-                                        if(f != NULL){
-                                            fseek(f,(*ch)->pos[n-1],SEEK_SET);
-                                            fwrite(&data,sizeof(int),1,f);
-                                            fclose(f);
-                                        }
-                                    }
-                                }else{
-                                    fseek((*ch)->f,(*ch)->offsets[n-1]+(*ch)->pos[n-1],SEEK_SET);
-                                    fwrite(&data,sizeof(int),1,(*ch)->f);
-                                }
+                                secwrite(L,*ch,n-1,(const uint8_t *)&data,sizeof(int));
                             }
                             break;
                     }
@@ -1105,11 +3544,22 @@ static int fplua_rens(lua_State *L){
         unsigned int n = luaL_checknumber(L, 2);
         if(n > 0 && n < (*ch)->chead.nofsec+1){
             const char *name = luaL_checkstring (L,3);
-            strcpy((*ch)->heads[n-1].name,name);
+            if(!chedit(*ch)) return 0;
+            strncpy((char *)(*ch)->heads[n-1].name,name,sizeof((*ch)->heads[n-1].name)-1);
+            (*ch)->heads[n-1].name[sizeof((*ch)->heads[n-1].name)-1] = '\0';
             if((*ch)->_io != 1){
                 unsigned int p = (*ch)->Coffset + sizeof(CORE_HEADER) + ((n-1)*sizeof(SECTION_HEADER));
+                chlock(*ch);
                 fseek((*ch)->f,p,SEEK_SET);
                 fwrite((*ch)->heads[n-1].name,sizeof((*ch)->heads[n-1].name),1,(*ch)->f);
+                if((*ch)->checked != NULL) bitclear((*ch)->checked,n-1);
+                chindex(*ch);
+                if((*ch)->ver == BUNDLEVER && (*ch)->hidx != NULL){ /* keep the on-disk index in step */
+                    fseek((*ch)->f,(*ch)->xoff + sizeof(CORE_INDEX) + sizeof(uint32_t)*((*ch)->chead.nofsec+1),SEEK_SET);
+                    fwrite((*ch)->hidx,sizeof(uint32_t),(*ch)->hsize,(*ch)->f);
+                }
+                fflush((*ch)->f);
+                chunlock(*ch);
             }
         }
     }
@@ -1138,42 +3588,498 @@ static int fplua_setfile(lua_State *L){
         FILE *f = fopen(fname,"rb");
         if(f != NULL){
         unsigned int fnsize = strlen(fname);
-        (*ch)->data[n-1].filename = (char*)malloc(fnsize);
+        (*ch)->data[n-1].filename = (char*)malloc(fnsize+1);
         strcpy((*ch)->data[n-1].filename,fname);
         (*ch)->wtype[n-1] = 2;
         (*ch)->pos[n-1] = 0;
-        (*ch)->heads[n-1].size = _filelength(_fileno(f));
+        (*ch)->heads[n-1].size = flength(f);
+        if(lua_toboolean(L, 4)) (*ch)->wflags[n-1] |= 0x01;
         fclose(f);
         }
     }
     return 0;
 }
 
+static int fplua_compile(lua_State *L){
+    CORE_HANDLE **ch = tochp(L);
+    if((*ch)->_io == 1){
+        unsigned int n = luaL_checkinteger(L, 2);
+        if(n > 0 && n < (*ch)->chead.nofsec+1){
+            if(lua_isnoneornil(L, 3) || lua_toboolean(L, 3)){
+                (*ch)->wflags[n-1] |= 0x01;
+            }else{
+                (*ch)->wflags[n-1] &= ~0x01;
+            }
+        }
+    }
+    return 0;
+}
+
+/* compile section i of a builder handle to stamped luaU_dump output */
+static uint8_t *compilesection(lua_State *L, CORE_HANDLE *ch, unsigned int i, unsigned int *size){
+    int status;
+    DUMPBUF d = {NULL,0,0};
+    if(ch->wtype[i] == 1){
+        status = luaL_loadbuffer(L,(const char *)ch->data[i].data,ch->heads[i].size,(const char *)ch->heads[i].name);
+    }else if(ch->wtype[i] == 2){
+        status = luaL_loadfile(L,ch->data[i].filename);
+    }else{
+        lua_pushfstring(L,"section %d has no contents to compile",i+1);
+        return NULL;
+    }
+    if(status != 0) return NULL;
+    dumpwriter(L,bcstamp,sizeof(bcstamp),&d);
+    lua_dump(L,dumpwriter,&d);
+    lua_pop(L,1);
+    *size = d.n;
+    return d.b;
+}
+
+/* read a whole file into a malloc'd buffer */
+static uint8_t *readwhole(const char *fname, size_t *size){
+    FILE *f = fopen(fname,"rb");
+    uint8_t *b;
+    if(f == NULL) return NULL;
+    fseek(f,0,SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+    b = malloc(*size+1);
+    if(b != NULL) *size = fread(b,1,*size,f);
+    fclose(f);
+    return b;
+}
+
+/* pack raw bytes as a compressed (0x40) section payload */
+static uint8_t *zpack(const uint8_t *raw, size_t size, unsigned int *psize){
+    size_t cap = sizeof(ZHEADER) + (size/ZBLOCK+1)*(2*sizeof(uint32_t)+LZ4_COMPRESSBOUND(ZBLOCK));
+    uint8_t *out = malloc(cap);
+    ZHEADER zh;
+    size_t o;
+    if(out == NULL) return NULL;
+    zh.rawsize = size;
+    zh.blocksize = ZBLOCK | ZINDEX;
+    memcpy(out,&zh,sizeof(zh));
+    o = sizeof(zh)+sizeof(uint32_t)*zblocks(&zh);
+    for(size_t p = 0;p<size;p += ZBLOCK){
+        uint32_t boff = o;
+        memcpy(out+sizeof(zh)+sizeof(uint32_t)*(p/ZBLOCK),&boff,sizeof(boff));
+        int n = (size-p < ZBLOCK) ? (int)(size-p) : ZBLOCK;
+        int c = LZ4_compress_default((const char *)raw+p,(char *)out+o+sizeof(uint32_t),n,LZ4_COMPRESSBOUND(ZBLOCK));
+        uint32_t clen = c;
+        if(c <= 0 || c >= n){ /* incompressible: keep the block as it is */
+            memcpy(out+o+sizeof(uint32_t),raw+p,n);
+            c = n;
+            clen = n | ZSTORED;
+        }
+        memcpy(out+o,&clen,sizeof(clen));
+        o += sizeof(clen)+c;
+    }
+    *psize = o;
+    return out;
+}
+
+/* bytes of a section being saved, from memory or streamed from its file */
+typedef struct{
+    const uint8_t *p;
+    FILE *f;
+    size_t left;
+} SRC;
+
+#define SAVEBUF	(1<<20)	/* bytes per read or write when streaming sections */
+
+static int srcopen(SRC *s, CORE_HANDLE *ch, unsigned int i, const uint8_t *payload, size_t size){
+    s->p = payload;
+    s->f = NULL;
+    s->left = size;
+    if(s->p == NULL && ch->wtype[i] == 1) s->p = ch->data[i].data;
+    if(s->p == NULL && ch->wtype[i] == 2) s->f = fopen(ch->data[i].filename,"rb");
+    return s->p != NULL || s->f != NULL;
+}
+
+/* next chunk of at most cap bytes; *out points into memory sources, else at buf */
+static size_t srcnext(SRC *s, uint8_t *buf, size_t cap, const uint8_t **out){
+    size_t n = (s->left < cap) ? s->left : cap;
+    if(n == 0) return 0;
+    if(s->p != NULL){
+        *out = s->p;
+        s->p += n;
+    }else{
+        n = fread(buf,1,n,s->f);
+        *out = buf;
+    }
+    s->left -= n;
+    return n;
+}
+
+static void srcclose(SRC *s){
+    if(s->f != NULL) fclose(s->f);
+}
+
+/* FNV-1a over the saved bytes of section i, with their CRC32C in the same pass */
+static uint64_t srchash(CORE_HANDLE *ch, SECTION_HEADER *heads, uint8_t **payload, unsigned int i, uint8_t *buf, uint32_t *crc){
+    uint64_t h = 14695981039346656037ull;
+    const uint8_t *p;
+    size_t n;
+    SRC s;
+    *crc = 0;
+    if(!srcopen(&s,ch,i,payload[i],heads[i].size)) return 0;
+    while((n = srcnext(&s,buf,SAVEBUF,&p)) > 0){
+        for(size_t k = 0;k<n;k++) h = (h ^ p[k]) * 1099511628211ull;
+        *crc = crc32c(*crc,p,n);
+    }
+    srcclose(&s);
+    return h;
+}
+
+/* do sections i and j save the same bytes? */
+static int srcsame(CORE_HANDLE *ch, SECTION_HEADER *heads, uint8_t **payload, unsigned int i, unsigned int j, uint8_t *buf){
+    const uint8_t *pa = buf, *pb = buf;
+    size_t na, nb;
+    int same;
+    SRC a, b;
+    if(heads[i].size != heads[j].size || !srcopen(&a,ch,i,payload[i],heads[i].size)) return 0;
+    if(!srcopen(&b,ch,j,payload[j],heads[j].size)){
+        srcclose(&a);
+        return 0;
+    }
+    do{
+        na = srcnext(&a,buf,SAVEBUF,&pa);
+        nb = srcnext(&b,buf+SAVEBUF,SAVEBUF,&pb);
+        same = (na == nb) && memcmp(pa,pb,na) == 0;
+    }while(same && na > 0);
+    same = same && a.left == 0 && b.left == 0;
+    srcclose(&a);
+    srcclose(&b);
+    return same;
+}
+
+/*
+** content-addressed dedup over the hashes taken by prepsections: same[i]
+** is the earlier section whose bytes section i shares (0x10 aliases
+** included), or i when it is written out. Only modules and compiled or
+** compressed sections are merged: a loaded bundle cannot tell merged
+** sections from aliases, so fwrite and h:update on one would reach all
+** of them, and data sections keep their own bytes.
+*/
+static void dedup(CORE_HANDLE *ch, SECTION_HEADER *heads, uint8_t **payload, unsigned int *same,
+                  const uint64_t *hash, uint32_t *crc, uint8_t *buf){
+    unsigned int n = ch->chead.nofsec, size = chhsize(n), h, s;
+    unsigned int *tab = calloc(size,sizeof(unsigned int));
+    for(unsigned int i = 0;i<n;i++){
+        same[i] = i;
+        if(i != 0 && (ch->heads[i].Characteristics & 0x10)){
+            same[i] = same[i-1];
+            crc[i] = crc[same[i]];
+            continue;
+        }
+        if(heads[i].size == 0 || tab == NULL || (heads[i].Characteristics & (0x02|0x04|0x08|0x20|0x40)) == 0) continue;
+        for(h = (unsigned int)hash[i] & (size-1);(s = tab[h]) != 0;h = (h+1) & (size-1)){
+            if(hash[s-1] == hash[i] && srcsame(ch,heads,payload,s-1,i,buf)){
+                same[i] = s-1;
+                break;
+            }
+        }
+        if(same[i] == i) tab[h] = i+1;
+    }
+    free(tab);
+}
+
+/* savefile's per-section work, shared by a pool of threads */
+typedef struct{
+    CORE_HANDLE *ch;
+    SECTION_HEADER *heads;
+    uint8_t **payload;
+    uint64_t *hash;
+    uint32_t *crc;
+    char **err;            /* why section i could not be prepared */
+    volatile unsigned int next;  /* next section to take */
+} SAVEJOB;
+
+static char *errcopy(const char *msg){
+    char *e = malloc(strlen(msg)+1);
+    return (e != NULL) ? strcpy(e,msg) : NULL;
+}
+
+/* replace the contents of section i by their compressed (0x40) form */
+static void packsection(SAVEJOB *j, unsigned int i){
+    CORE_HANDLE *ch = j->ch;
+    const uint8_t *raw = j->payload[i];
+    size_t rawsize = j->heads[i].size;
+    uint8_t *owned = j->payload[i];
+    if(raw == NULL){
+        if(ch->wtype[i] == 1){
+            raw = ch->data[i].data;
+        }else if(ch->wtype[i] == 2){
+            raw = owned = readwhole(ch->data[i].filename,&rawsize);
+        }
+    }
+    unsigned int size = 0;
+    uint8_t *packed = (raw != NULL) ? zpack(raw,rawsize,&size) : NULL;
+    if(packed != NULL){
+        j->payload[i] = packed;
+        j->heads[i].size = size;
+        free(owned);
+    }else{ /* out of memory: store it as it is */
+        j->payload[i] = owned;
+        j->heads[i].size = rawsize;
+        j->heads[i].Characteristics &= ~0x40;
+    }
+}
+
+/*
+** take sections until none are left: compile them (each thread with a
+** lua_State of its own), compress them, then hash and checksum the bytes
+** to be stored. Sections only ever touch their own slots.
+*/
+static void prepsections(SAVEJOB *j){
+    lua_State *WL = NULL;
+    uint8_t *buf = malloc(SAVEBUF);
+    unsigned int i;
+    if(buf == NULL) return; /* leave the sections to the other threads */
+    while((i = __sync_fetch_and_add(&j->next,1)) < j->ch->chead.nofsec){
+        if(i != 0 && (j->ch->heads[i].Characteristics & 0x10)) continue;
+        if(j->ch->wflags[i] & 0x01){
+            unsigned int size = 0;
+            if(WL == NULL && (WL = luaL_newstate()) == NULL){
+                j->err[i] = errcopy("not enough memory");
+                continue;
+            }
+            j->payload[i] = compilesection(WL,j->ch,i,&size);
+            if(j->payload[i] == NULL){
+                const char *msg = lua_tostring(WL,-1);
+                j->err[i] = errcopy((msg != NULL) ? msg : "not enough memory");
+                lua_settop(WL,0);
+                continue;
+            }
+            j->heads[i].size = size;
+            j->heads[i].Characteristics |= 0x20;
+        }
+        if(j->heads[i].Characteristics & 0x40) packsection(j,i);
+        if(j->heads[i].size > 0) j->hash[i] = srchash(j->ch,j->heads,j->payload,i,buf,&j->crc[i]);
+    }
+    if(WL != NULL) lua_close(WL);
+    free(buf);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI prepthread(LPVOID j){
+    prepsections((SAVEJOB *)j);
+    return 0;
+}
+#else
+static void *prepthread(void *j){
+    prepsections((SAVEJOB *)j);
+    return NULL;
+}
+#endif
+
+static unsigned int ncpus(void){
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (unsigned int)n : 1;
+#endif
+}
+
+#define MAXSAVETHREADS	64
+
+/* run prepsections on nthreads threads, the calling one included */
+static void preppool(SAVEJOB *j, unsigned int nthreads){
+#if defined(_WIN32)
+    HANDLE t[MAXSAVETHREADS];
+#else
+    pthread_t t[MAXSAVETHREADS];
+#endif
+    unsigned int started = 0;
+    if(nthreads > MAXSAVETHREADS) nthreads = MAXSAVETHREADS;
+    if(nthreads > j->ch->chead.nofsec) nthreads = j->ch->chead.nofsec;
+    for(;started+1 < nthreads;started++){
+#if defined(_WIN32)
+        if((t[started] = CreateThread(NULL,0,prepthread,j,0,NULL)) == NULL) break;
+#else
+        if(pthread_create(&t[started],NULL,prepthread,j) != 0) break;
+#endif
+    }
+    prepsections(j);
+    for(unsigned int k = 0;k<started;k++){
+#if defined(_WIN32)
+        WaitForSingleObject(t[k],INFINITE);
+        CloseHandle(t[k]);
+#else
+        pthread_join(t[k],NULL);
+#endif
+    }
+}
+
+/*
+** append size bytes of file fname to f; the kernel copies them when it
+** can (copy_file_range, then sendfile), else they go through buf
+*/
+static int copyfile(FILE *f, const char *fname, size_t size, uint8_t *buf){
+    FILE *src = fopen(fname,"rb");
+    size_t done = 0;
+    long start = ftell(f);
+    if(src != NULL){
+#if defined(__linux__)
+        off_t in = 0;
+        fflush(f);
+#if defined(SYS_copy_file_range)
+        loff_t cin = 0, cout = start;
+        while(done < size){
+            ssize_t k = syscall(SYS_copy_file_range,fileno(src),&cin,fileno(f),&cout,size-done,0);
+            if(k <= 0) break;
+            done += k;
+        }
+        in = done;
+#endif
+        if(done < size && lseek(fileno(f),start+done,SEEK_SET) == (off_t)(start+done)){
+            while(done < size){
+                ssize_t k = sendfile(fileno(f),fileno(src),&in,size-done);
+                if(k <= 0) break;
+                done += k;
+            }
+        }
+        fseek(f,start+done,SEEK_SET);
+        fseek(src,done,SEEK_SET);
+#endif
+        while(done < size){
+            size_t k = fread(buf,1,(size-done < SAVEBUF) ? size-done : SAVEBUF,src);
+            if(k == 0 || fwrite(buf,1,k,f) != k) break;
+            done += k;
+        }
+        fclose(src);
+    }
+    return done == size;
+}
+
 static int fplua_save(lua_State *L){
     CORE_HANDLE **ch = tochp(L);
     if((*ch)->_io == 1){
        const char *fname = luaL_checkstring(L, 2);
-       FILE *f = fopen(fname,"wb");
+       unsigned int n = (*ch)->chead.nofsec;
+       unsigned int nthreads = luaL_optinteger(L, 3, ncpus());
+       SAVEJOB job;
+       job.ch = *ch;
+       job.next = 0;
+       job.payload = calloc(n+1,sizeof(uint8_t *));
+       job.heads = malloc(sizeof(SECTION_HEADER)*n+1);
+       job.hash = calloc(n+1,sizeof(uint64_t));
+       job.crc = calloc(n+1,sizeof(uint32_t));
+       job.err = calloc(n+1,sizeof(char *));
+       if(job.payload != NULL && job.heads != NULL && job.hash != NULL && job.crc != NULL && job.err != NULL){
+            memcpy(job.heads,(*ch)->heads,sizeof(SECTION_HEADER)*n);
+            preppool(&job,(nthreads > 0) ? nthreads : 1);
+       }
+       const char *failed = (job.next < n) ? "not enough memory" : NULL;
+       for(unsigned int i = 0;i<n && failed == NULL;i++){
+            if(job.err != NULL && job.err[i] != NULL) failed = job.err[i]; /* the first one, whatever the timing */
+       }
+       if(failed != NULL){
+            lua_pushstring(L,failed);
+            for(unsigned int i = 0;i<n;i++){
+                if(job.payload != NULL) free(job.payload[i]);
+                if(job.err != NULL) free(job.err[i]);
+            }
+            free(job.payload);
+            free(job.heads);
+            free(job.hash);
+            free(job.crc);
+            free(job.err);
+            return lua_error(L);
+       }
+       uint8_t **payload = job.payload;
+       SECTION_HEADER *heads = job.heads;
+       uint32_t *crc = job.crc;
+       CORE_INDEX x;
+       x.hsize = chhsize(n);
+       x.nauto = 0;
+       uint32_t *offs = malloc(sizeof(uint32_t)*(n+1));
+       unsigned int *hidx = malloc(sizeof(unsigned int)*x.hsize);
+       uint32_t *autorun = malloc(sizeof(uint32_t)*n+1);
+       unsigned int *same = malloc(sizeof(unsigned int)*n+1);
+       uint8_t *buf = malloc(2*SAVEBUF);
+       FILE *f = NULL;
+       if(offs == NULL || hidx == NULL || autorun == NULL || same == NULL || buf == NULL)
+            failed = "not enough memory";
+       else if((f = fopen(fname,"wb")) == NULL)
+            failed = "cannot write bundle";
        if(f != NULL){
-            fwrite(&luasig,sizeof(SIGNATURE),1,f);
+            int ok = 1;
+            setvbuf(f,NULL,_IOFBF,SAVEBUF);
+            dedup(*ch,heads,payload,same,job.hash,crc,buf);
+            x.flags = XCRC;
+            /* aliases are resolved here, so readers never look back */
+            for(unsigned int i = 0;i<n;i++){
+                if(i != 0 && ((*ch)->heads[i].Characteristics & 0x10)){
+                    heads[i].size = heads[i-1].size;
+                    heads[i].Characteristics = heads[i-1].Characteristics;
+                }
+                heads[i].name[58] = '\0';
+                if(heads[i].Characteristics & 0x01) autorun[x.nauto++] = i;
+            }
+            unsigned int at = sizeof(CORE_HEADER)+sizeof(SECTION_HEADER)*n+sizeof(CORE_INDEX)
+                              +sizeof(uint32_t)*(n+1+x.hsize+n+x.nauto);
+            for(unsigned int i = 0;i<n;i++){
+                if(same[i] != i){
+                    offs[i] = offs[same[i]];
+                }else{
+                    offs[i] = at;
+                    at += heads[i].size;
+                }
+            }
+            offs[n] = at;
+            chhfill(hidx,x.hsize,heads,n);
+            SIGNATURE sig;
+            memcpy(sig,luasig,sizeof(SIGNATURE));
+            sig[sizeof(SIGNATURE)-1] = BUNDLEVER;
+            fwrite(sig,sizeof(SIGNATURE),1,f);
             fwrite(&(*ch)->chead,sizeof((*ch)->chead),1,f);
-            fwrite((*ch)->heads,sizeof(SECTION_HEADER),(*ch)->chead.nofsec,f);
-            for(unsigned int i = 0;i<(*ch)->chead.nofsec;i++){
-                if((*ch)->wtype[i] == 1){
+            fwrite(heads,sizeof(SECTION_HEADER),n,f);
+            fwrite(&x,sizeof(x),1,f);
+            fwrite(offs,sizeof(uint32_t),n+1,f);
+            fwrite(hidx,sizeof(unsigned int),x.hsize,f);
+            fwrite(crc,sizeof(uint32_t),n,f);
+            fwrite(autorun,sizeof(uint32_t),x.nauto,f);
+            for(unsigned int i = 0;i<n;i++){
+                if(same[i] != i){
+                    continue;
+                }else if(payload[i] != NULL){
+                    fwrite(payload[i],heads[i].size,1,f);
+                }else if((*ch)->wtype[i] == 1){
                     fwrite((*ch)->data[i].data,(*ch)->heads[i].size,1,f);
                 }else if((*ch)->wtype[i] == 2){
-                    FILE *f2 = fopen((*ch)->data[i].filename,"rb");
-                    if(f2 != NULL){
-                        for(int n = 0;n<(*ch)->heads[i].size;n++){
-                            char buff = fgetc(f2);
-                            fputc(buff,f);
-                        }
-                        fclose(f2);
-                    }
-
+                    ok = copyfile(f,(*ch)->data[i].filename,heads[i].size,buf) && ok;
                 }
             }
-            fclose(f);
+            TRAILER t;
+            t.size = ftell(f);
+            t.journal = 0;
+            memcpy(t.magic,trailmagic,sizeof(trailmagic));
+            fwrite(&t,sizeof(t),1,f);
+            ok = !ferror(f) && ok;  /* every fwrite above leaves its error here */
+            ok = (fclose(f) == 0) && ok;
+            if(!ok){
+                failed = "cannot write bundle";
+                remove(fname);  /* no truncated bundle left behind */
+            }
+       }
+       for(unsigned int i = 0;i<n;i++) free(payload[i]);
+       free(payload);
+       free(heads);
+       free(offs);
+       free(hidx);
+       free(autorun);
+       free(same);
+       free(buf);
+       free(job.hash);
+       free(job.crc);
+       free(job.err);
+       if(failed != NULL){
+            lua_pushstring(L,failed);
+            return lua_error(L);
        }
     }
     return 0;
@@ -1181,10 +4087,12 @@ static int fplua_save(lua_State *L){
 
 static int fplua_close(lua_State *L){
     CORE_HANDLE **ch = tochp(L);
+    if(*ch == NULL) return 0;
     if((*ch)->_io == 0){
-    fclose((*ch)->f);
+        chrelease(*ch); /* views may still point into the mapping */
+    }else{
+        free(*ch);
     }
-    free(*ch);
     *ch = NULL;
     ch = NULL;
     return 0;
@@ -1203,24 +4111,48 @@ static int fplua_isf(lua_State *L){
 }
 
 static int plua_resR(lua_State *L){
-    C_ch = g_ch;
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_PLUAREQUIRE);
     return 0;
 }
 
+#if defined(LUA_COUNT_DISPATCH)
+/* plua.dispatches(): opcodes dispatched by the VM so far, see luai_vmdispatch */
+static int plua_dispatches(lua_State *L){
+    lua_pushnumber(L,(lua_Number)luaV_dispatches);
+    return 1;
+}
+#endif
+
 static const luaL_Reg plualib[] = {
   {"loadlib",       plua_llib},
   {"read",          plua_read},
+  {"view",          plua_view},
+  {"verify",        plua_verify},
+  {"cache",         plua_cache},
+  {"struct",        plua_struct},
   {"getn",          plua_getn},
   {"list",          plua_list},
   {"load",          plua_load},
   {"new" ,          plua_new},
   {"resetrequire",  plua_resR},
+#if defined(LUA_COUNT_DISPATCH)
+  {"dispatches",    plua_dispatches},
+#endif
   {NULL, NULL}
 };
 static const luaL_Reg fplualib[] = {
   {"loadlib",       fplua_llib},
   {"read",          fplua_read},
+  {"view",          fplua_view},
+  {"verify",        fplua_verify},
+  {"update",        fplua_update},
   {"fread",         fplua_fread},
+  {"freadarray",    fplua_freadarray},
+  {"pack",          fplua_pack},
+  {"unpack",        fplua_unpack},
+  {"packrecords",   fplua_packrecords},
+  {"unpackrecords", fplua_unpackrecords},
   {"fseek",         fplua_fseek},
   {"fwrite",        fplua_fwrite},
   {"getn",          fplua_getn},
@@ -1234,8 +4166,10 @@ static const luaL_Reg fplualib[] = {
   {"rename",     fplua_rens},
   {"alloc",      fplua_alloc},
   {"setfile",       fplua_setfile},
+  {"compile",       fplua_compile},
   {"savefile",      fplua_save},
   {"close",         fplua_close},
+  {"__gc",          fplua_close},
   {NULL, NULL}
 };
 
@@ -1244,6 +4178,19 @@ static void createmeta (lua_State *L) {
   lua_pushvalue(L, -1);  /* push metatable */
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_register(L, NULL, fplualib);  /* pluafile methods */
+  luaL_newmetatable(L, LUA_PLUAVIEW);  /* create metatable for section views */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, viewlib);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LUA_PLUAARRAY);  /* create metatable for packed arrays */
+  luaL_register(L, NULL, arraylib);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LUA_PLUASTRUCT);  /* create metatable for record layouts */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, structlib);
+  lua_pop(L, 1);
 }
 
 int luaopen_plua(lua_State *L){
@@ -1264,51 +4211,54 @@ static int pmain (lua_State *L) {
   luaL_openlibs(L);  /* open libraries */
   lua_gc(L, LUA_GCRESTART, 0);
   s->status = handle_luainit(L);
-  FILE *f = fopen(getprog(),"rb");
-  pesize = sizeofpe(f);
-  fseek(f,0,SEEK_END);
-  filesize = ftell(f);
+  char *prog = getprog();
+  FILE *f = (prog != NULL) ? fopen(prog,"rb") : NULL;
+  free(prog);
+  pesize = filesize = 0;
+  if(f != NULL){
+    pesize = sizeofimage(f);
+    fseek(f,0,SEEK_END);
+    filesize = ftell(f);
+  }
   if (s->status != 0) return 0;
     if(filesize > pesize){
-    SIGNATURE sig;
-    fseek(f,pesize,SEEK_SET);
-    fread(sig,sizeof(SIGNATURE),1,f);
-    if(memcmp(&luasig,&sig,sizeof(SIGNATURE)) == 0){
-         g_ch = (CORE_HANDLE*)malloc(sizeof(CORE_HANDLE));
-         g_ch->f = f;
-         g_ch->Coffset = pesize+sizeof(SIGNATURE);
-         C_ch = g_ch;
-         int currpos;
-         fread(&g_ch->chead,sizeof(CORE_HEADER),1,f);
+    CORE_HANDLE *ch = chnew(f); /* one mapping serves every later section access */
+    if(ch == NULL) return luaL_error(L,"not enough memory");
+    long start = findbundle(ch,pesize,filesize);
+    if(start >= 0){
+         if(!chparse(ch,start)){
+            chclose(ch);
+            return luaL_error(L,"%s: bundle is corrupted",progname);
+         }
+         g_ch = ch;
+         chwarm(g_ch);
          if((g_ch->chead.conf[3] & 0x04) == 0x04){luaopen_bit(L);}
          if((g_ch->chead.conf[3] & 0x02) == 0x02){luaopen_plua(L);}
+         if((g_ch->chead.conf[3] & 0x10) == 0x10){preloadall(L,g_ch);}
          if(!(g_ch->chead.conf[3] & 0x01)){
             goto luatty;
          }
-         g_ch->heads = malloc(sizeof(SECTION_HEADER)*g_ch->chead.nofsec);
-         g_ch->offsets = malloc(sizeof(unsigned int)*(g_ch->chead.nofsec+1));
-         fread(g_ch->heads,sizeof(SECTION_HEADER),g_ch->chead.nofsec,f);
-         currpos = g_ch->Coffset+sizeof(CORE_HEADER)+sizeof(SECTION_HEADER)*g_ch->chead.nofsec;
-         for(unsigned int i = 0; i < g_ch->chead.nofsec; i++){
-             g_ch->heads[i].name[58] = '\0';
-             if(!checkString(g_ch->heads[i].name)){return 0;}
-             if(((g_ch->heads[i].Characteristics & 0x10) == 0x10)&& (i != 0)){
-                g_ch->offsets[i] = g_ch->offsets[i-1];
-                g_ch->heads[i].size = g_ch->heads[i-1].size;
-                g_ch->heads[i].Characteristics = g_ch->heads[i-1].Characteristics;
-             }else{
-             g_ch->offsets[i] = currpos;
-             currpos += g_ch->heads[i].size;
-             }
-         }
-         g_ch->offsets[g_ch->chead.nofsec] = currpos;
-         for (unsigned int i = 0;i<g_ch->chead.nofsec;i++){
-            if(g_ch->heads[i].Characteristics & 0x01){
-                load(L,f,g_ch->heads[i].name,g_ch->offsets[i],g_ch->heads[i].size);
+         if(g_ch->autorun != NULL){
+            for (unsigned int k = 0;k<g_ch->nauto;k++){
+               unsigned int i = g_ch->autorun[k];
+               if(!chsec(g_ch,i)) return luaL_error(L,"%s: bundle is corrupted",progname);
+               if(g_ch->heads[i].Characteristics & 0x01){
+                   loadsection(L,g_ch,i);
+               }
+            }
+         }else{
+            for (unsigned int i = 0;i<g_ch->chead.nofsec;i++){
+               if(!chsec(g_ch,i)) return luaL_error(L,"%s: bundle is corrupted",progname);
+               if(g_ch->heads[i].Characteristics & 0x01){
+                   loadsection(L,g_ch,i);
+               }
             }
          }
     }else{
-         load(L,f,"=",pesize,filesize-pesize);
+         State S;
+         sopen(&S,ch,pesize,filesize-pesize,0);
+         load(L,&S,"=");
+         chclose(ch);
     }
     int i;
     lua_createtable(L,argc,0);
@@ -49,6 +49,7 @@
 /*
 @@ LUA_USE_POSIX includes all functionallity listed as X/Open System
 @* Interfaces Extension (XSI).
+@@ LUA_USE_MMAP lets the bundle reader map the appended payload with mmap.
 ** CHANGE it (define it) if your system is XSI compatible.
 */
 #if defined(LUA_USE_POSIX)
@@ -56,6 +57,7 @@
 #define LUA_USE_ISATTY
 #define LUA_USE_POPEN
 #define LUA_USE_ULONGJMP
+#define LUA_USE_MMAP
 #endif
 
 
@@ -582,6 +584,17 @@ union luai_Cast { double l_d; long l_l; };
 
 #endif
 
+
+/*
+@@ LUA_USE_INTSUBTYPE keeps numbers that hold an int as ints inside the
+@* core, so loop counters, array indices and integer arithmetic do not
+@* go through the FPU. Lua code and the API still see only numbers.
+** CHANGE it (undefine it) if lua_Number cannot hold every int exactly.
+*/
+#if defined(LUA_NUMBER_DOUBLE) && INT_MAX == 2147483647
+#define LUA_USE_INTSUBTYPE
+#endif
+
 /* }================================================================== */
 
 
@@ -706,6 +719,30 @@ union luai_Cast { double l_d; long l_l; };
 #endif
 
 
+/*
+@@ LUA_USE_JUMPTABLE makes luaV_execute jump straight from one opcode to
+@* the next through a table of label addresses instead of a switch.
+** CHANGE it (undefine it) if your compiler does not support GNU C
+** labels as values.
+*/
+#if defined(__GNUC__) && !defined(LUA_ANSI)
+#define LUA_USE_JUMPTABLE
+#endif
+
+
+/*
+@@ luai_vmdispatch is called by luaV_execute each time it dispatches on
+@* an opcode (a fused opcode going on to its pair does not count).
+** CHANGE it (define LUA_COUNT_DISPATCH) to count dispatches in
+** luaV_dispatches, which lua.c reports as plua.dispatches().
+*/
+#if defined(LUA_COUNT_DISPATCH)
+#define luai_vmdispatch(L)	((void)L, luaV_dispatches++)
+#else
+#define luai_vmdispatch(L)	((void)L)
+#endif
+
+
 /*
 @@ LUAI_EXTRASPACE allows you to add user-specific data in a lua_State
 @* (the data goes just *before* the lua_State pointer).
@@ -117,7 +117,7 @@ static void LoadConstants(LoadState* S, Proto* f)
    	setbvalue(o,LoadChar(S)!=0);
 	break;
    case LUA_TNUMBER:
-	setnvalue(o,LoadNumber(S));
+	setnumvalue(o,LoadNumber(S));
 	break;
    case LUA_TSTRING:
 	setsvalue2n(S->L,o,LoadString(S));
@@ -175,6 +175,7 @@ static Proto* LoadFunction(LoadState* S, TString* p)
  LoadConstants(S,f);
  LoadDebug(S,f);
  IF (!luaG_checkcode(f), "bad code");
+ luaF_initcache(S->L,f);
  S->L->top--;
  S->L->nCcalls--;
  return f;
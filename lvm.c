@@ -32,6 +32,11 @@
 #define MAXTAGLOOP	100
 
 
+#if defined(LUA_COUNT_DISPATCH)
+unsigned long luaV_dispatches = 0;  /* see luai_vmdispatch */
+#endif
+
+
 const TValue *luaV_tonumber (const TValue *obj, TValue *n) {
   lua_Number num;
   if (ttisnumber(obj)) return obj;
@@ -224,7 +229,9 @@ static int l_strcmp (const TString *ls, const TString *rs) {
 
 int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   int res;
-  if (ttype(l) != ttype(r))
+  if (ttisint(l) && ttisint(r))
+    return ivalue(l) < ivalue(r);
+  else if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
   else if (ttisnumber(l))
     return luai_numlt(nvalue(l), nvalue(r));
@@ -238,7 +245,9 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
 
 static int lessequal (lua_State *L, const TValue *l, const TValue *r) {
   int res;
-  if (ttype(l) != ttype(r))
+  if (ttisint(l) && ttisint(r))
+    return ivalue(l) <= ivalue(r);
+  else if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
   else if (ttisnumber(l))
     return luai_numle(nvalue(l), nvalue(r));
@@ -257,7 +266,10 @@ int luaV_equalval (lua_State *L, const TValue *t1, const TValue *t2) {
   lua_assert(ttype(t1) == ttype(t2));
   switch (ttype(t1)) {
     case LUA_TNIL: return 1;
-    case LUA_TNUMBER: return luai_numeq(nvalue(t1), nvalue(t2));
+    case LUA_TNUMBER: {
+      if (ttisint(t1) && ttisint(t2)) return ivalue(t1) == ivalue(t2);
+      return luai_numeq(nvalue(t1), nvalue(t2));
+    }
     case LUA_TBOOLEAN: return bvalue(t1) == bvalue(t2);  /* true must be 1 !! */
     case LUA_TLIGHTUSERDATA: return pvalue(t1) == pvalue(t2);
     case LUA_TUSERDATA: {
@@ -337,12 +349,196 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 }
 
 
+/*
+** Arithmetic on the integer subtype (see lobject.h). Each one sets `r'
+** and is true only when `r' is exactly what the lua_Number operation
+** gives: no overflow and no -0. Otherwise the operands take the
+** lua_Number path, which is the promotion to double.
+*/
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define intadd(r,a,b)	(!__builtin_add_overflow(a, b, &(r)))
+#define intsub(r,a,b)	(!__builtin_sub_overflow(a, b, &(r)))
+#define intmul(r,a,b)	(!__builtin_mul_overflow(a, b, &(r)) && \
+			 ((r) != 0 || ((a) | (b)) >= 0))
+#else
+#define intadd(r,a,b) \
+	((r) = cast_int(cast(unsigned int, a) + cast(unsigned int, b)), \
+	 (((a) ^ (r)) & ((b) ^ (r))) >= 0)
+#define intsub(r,a,b) \
+	((r) = cast_int(cast(unsigned int, a) - cast(unsigned int, b)), \
+	 (((a) ^ (b)) & ((a) ^ (r))) >= 0)
+#define intsmall(a)	(cast(unsigned int, a) + 46340u <= 92680u)
+#define intmul(r,a,b)	(intsmall(a) && intsmall(b) && \
+			 ((r) = (a) * (b), (r) != 0 || ((a) | (b)) >= 0))
+#endif
+#define intmod(r,a,b)	((b) > 0 && \
+			 ((r) = (a) % (b), (r) < 0 ? ((r) += (b), 1) : 1))
+#define intnone(r,a,b)	0
+
+
+#if defined(LUA_USE_INTSUBTYPE)
+/*
+** makes the numeric for loop at `ra' an integer one when its initial
+** value and step are ints and its limit, rounded towards the initial
+** value, fits an int; OP_FORLOOP can then stop when the index overflows,
+** as it is past the limit by then
+*/
+static int forint (StkId ra) {
+  lua_Number n;
+  int init, limit, step, idx;
+  n = nvalue(ra);
+  lua_number2int(init, n);
+  if (!isintnum(init, n)) return 0;
+  n = nvalue(ra+2);
+  lua_number2int(step, n);
+  if (!isintnum(step, n)) return 0;
+  n = (step > 0) ? floor(nvalue(ra+1)) : ceil(nvalue(ra+1));
+  lua_number2int(limit, n);
+  if (!luai_numeq(cast_num(limit), n) || !intsub(idx, init, step))
+    return 0;
+  setivalue(ra, idx);
+  setivalue(ra+1, limit);
+  setivalue(ra+2, step);
+  return 1;
+}
+#else
+#define forint(ra)	0
+#endif
+
+
+/*
+** non-nil value in the array part of `t' at int `k', or NULL; anything
+** else (hash part, nil, metamethods) takes the luaV_gettable way
+*/
+#define arrayfield(v,t,k) { \
+  if (ttistable(t)) { \
+    Table *h_ = hvalue(t); \
+    unsigned int k_ = cast(unsigned int, k) - 1; \
+    if (k_ < cast(unsigned int, h_->sizearray) && !ttisnil(&h_->array[k_])) \
+      v = &h_->array[k_]; \
+  } }
+
+
+/* refill inline cache `c' for field `key' of `h'; NULL if there is none */
+static TValue *icmiss (ICache *c, Table *h, TString *key) {
+  int slot = luaH_strslot(h, key);
+  TValue *v;
+  if (slot < 0) return NULL;
+  c->node = h->node;
+  c->slot = slot;
+  v = gval(gnode(h, slot));
+  return ttisnil(v) ? NULL : v;
+}
+
+
+/*
+** set `v' to field `key' (a constant string) of `t' for the current
+** instruction, looked up through its inline cache: the cached node is
+** still right while `t' keeps the same node array and the node still
+** holds `key'. `v' is NULL when `t' is not a table or the field is nil,
+** which leaves metamethods to luaV_gettable and luaV_settable.
+*/
+#define icfield(v,t,key) { \
+  Proto *p_ = cl->p; \
+  v = NULL; \
+  if (p_->ic != NULL && ttistable(t)) { \
+    ICache *c_ = &p_->ic[pc - 1 - p_->code]; \
+    Table *h_ = hvalue(t); \
+    if (h_->node == c_->node && c_->slot < sizenode(h_) && \
+        ttisstring(gkey(gnode(h_, c_->slot))) && \
+        rawtsvalue(gkey(gnode(h_, c_->slot))) == rawtsvalue(key)) { \
+      if (!ttisnil(gval(gnode(h_, c_->slot)))) v = gval(gnode(h_, c_->slot)); \
+    } \
+    else v = icmiss(c_, h_, rawtsvalue(key)); \
+  } }
+
+
+
+/* refill global cache `c' for `key' in `h'; NULL if the global is nil */
+static TValue *gcmiss (GCache *c, Table *h, TString *key) {
+  const TValue *v = luaH_getstr(h, key);
+  if (v == luaO_nilobject) return NULL;  /* no node to point at */
+  c->value = cast(TValue *, v);
+  c->version = h->version;
+  return ttisnil(v) ? NULL : c->value;
+}
+
+
+/*
+** set `v' to global `key' of environment `h' for the current GETGLOBAL
+** or SETGLOBAL, through the cache of its constant; NULL if it is nil,
+** which leaves metamethods to luaV_gettable and luaV_settable
+*/
+#define gcfield(v,h,key) { \
+  GCache *c_ = &cl->p->gcache[GETARG_Bx(i)]; \
+  lua_assert(cl->p->gcache != NULL); \
+  if (c_->version == (h)->version) \
+    v = ttisnil(c_->value) ? NULL : c_->value; \
+  else v = gcmiss(c_, h, rawtsvalue(key)); }
+
+
 
 /*
 ** some macros for common tasks in `luaV_execute'
 */
 
-#define runtime_check(L, c)	{ if (!(c)) break; }
+/*
+** with LUA_USE_JUMPTABLE each opcode ends by fetching and jumping to the
+** next one itself. Line and count hooks are tested on a slow path: while
+** they are set, disp points at a table that sends every opcode through
+** L_hook. hookcheck picks the table again wherever hooks may have changed:
+** on entry, after any call out of the VM and on jumps, so a hook set
+** from a signal handler is still seen inside a loop.
+*/
+#if defined(LUA_USE_JUMPTABLE)
+
+#define hookcheck(L) \
+	(disp = ((L)->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) ? hookops : ops)
+
+#define vmfetch()	{ \
+	i = *pc++; \
+	ra = RA(i); \
+	lua_assert(base == L->base && L->base == L->ci->base); \
+	lua_assert(base <= L->top && L->top <= L->stack + L->stacksize); \
+	lua_assert(L->top == L->ci->top || luaG_checkopenop(i)); }
+
+#define vmdispatch(o)	luai_vmdispatch(L); goto *disp[o];
+#define vmcase(l)	L_##l:
+#define vmbreak		{ vmfetch(); luai_vmdispatch(L); goto *disp[GET_OPCODE(i)]; }
+/* end of a fused opcode: the next instruction is known to be `l' */
+#define vmnext(l)	{ vmfetch(); lua_assert(GET_OPCODE(i) == l); \
+	if (disp != ops) goto L_hook; goto L_##l; }
+
+#else
+
+#define hookcheck(L)	((void)0)
+
+#define vmfetch()	{ \
+	i = *pc++; \
+	if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) && \
+	    (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) { \
+	  traceexec(L, pc); \
+	  if (L->status == LUA_YIELD) {  /* did hook yield? */ \
+	    L->savedpc = pc - 1; \
+	    return; \
+	  } \
+	  base = L->base; \
+	} \
+	/* warning!! several calls may realloc the stack and invalidate `ra' */ \
+	ra = RA(i); \
+	lua_assert(base == L->base && L->base == L->ci->base); \
+	lua_assert(base <= L->top && L->top <= L->stack + L->stacksize); \
+	lua_assert(L->top == L->ci->top || luaG_checkopenop(i)); }
+
+#define vmdispatch(o)	luai_vmdispatch(L); switch (o)
+#define vmcase(l)	case l:
+#define vmbreak		continue
+#define vmnext(l)	vmbreak
+
+#endif
+
+
+#define runtime_check(L, c)	{ if (!(c)) vmbreak; }
 
 #define RA(i)	(base+GETARG_A(i))
 /* to be used after possible stack reallocation */
@@ -355,16 +551,19 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 #define KBx(i)	check_exp(getBMode(GET_OPCODE(i)) == OpArgK, k+GETARG_Bx(i))
 
 
-#define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L);}
+#define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L); hookcheck(L);}
 
 
-#define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; }
+#define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; hookcheck(L); }
 
 
-#define arith_op(op,tm) { \
+#define arith_op(op,iop,tm) { \
         TValue *rb = RKB(i); \
         TValue *rc = RKC(i); \
-        if (ttisnumber(rb) && ttisnumber(rc)) { \
+        int ri; \
+        if (ttisint(rb) && ttisint(rc) && iop(ri, ivalue(rb), ivalue(rc))) \
+          setivalue(ra, ri) \
+        else if (ttisnumber(rb) && ttisnumber(rc)) { \
           lua_Number nb = nvalue(rb), nc = nvalue(rc); \
           setnvalue(ra, op(nb, nc)); \
         } \
@@ -373,149 +572,224 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
       }
 
 
+/*
+** bodies shared by an opcode and its fused form (see luaK_fuse); `done'
+** ends the opcode, with vmbreak or by running the second one of the pair
+*/
+#define getupval_op(done) { \
+        setobj2s(L, ra, cl->upvals[GETARG_B(i)]->v); \
+        done; \
+      }
 
+#define getglobal_op(done) { \
+        TValue g; \
+        TValue *rb = KBx(i); \
+        TValue *v; \
+        lua_assert(ttisstring(rb)); \
+        gcfield(v, cl->env, rb); \
+        if (v != NULL) { \
+          setobj2s(L, ra, v); \
+          done; \
+        } \
+        sethvalue(L, &g, cl->env); \
+        Protect(luaV_gettable(L, &g, rb, ra)); \
+        done; \
+      }
+
+#define self_op(done) { \
+        StkId rb = RB(i); \
+        TValue *v = NULL; \
+        if (ISK(GETARG_C(i)) && ttisstring(RKC(i))) icfield(v, rb, RKC(i)); \
+        setobjs2s(L, ra+1, rb); \
+        if (v != NULL) { \
+          setobj2s(L, ra, v); \
+          done; \
+        } \
+        Protect(luaV_gettable(L, rb, RKC(i), ra)); \
+        done; \
+      }
+
+
+#if defined(LUA_USE_JUMPTABLE) && !defined(__clang__)
+/* GCC would otherwise merge the dispatch jumps that end each opcode */
+__attribute__((optimize("no-crossjumping")))
+#endif
 void luaV_execute (lua_State *L, int nexeccalls) {
   LClosure *cl;
   StkId base;
   TValue *k;
   const Instruction *pc;
+  Instruction i;
+  StkId ra;
+#if defined(LUA_USE_JUMPTABLE)
+#include "ljumptab.h"
+  const void *const *disp;
+#endif
  reentry:  /* entry point */
   lua_assert(isLua(L->ci));
   pc = L->savedpc;
   cl = &clvalue(L->ci->func)->l;
   base = L->base;
   k = cl->p->k;
+  hookcheck(L);
   /* main loop of interpreter */
   for (;;) {
-    const Instruction i = *pc++;
-    StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      traceexec(L, pc);
-      if (L->status == LUA_YIELD) {  /* did hook yield? */
-        L->savedpc = pc - 1;
-        return;
+    vmfetch();
+    vmdispatch (GET_OPCODE(i)) {
+#if defined(LUA_USE_JUMPTABLE)
+      L_hook: {  /* every opcode lands here while line or count hooks are set */
+        if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
+            (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
+          traceexec(L, pc);
+          if (L->status == LUA_YIELD) {  /* did hook yield? */
+            L->savedpc = pc - 1;
+            return;
+          }
+          base = L->base;
+          ra = RA(i);
+          hookcheck(L);
+        }
+        goto *ops[GET_OPCODE(i)];
       }
-      base = L->base;
-    }
-    /* warning!! several calls may realloc the stack and invalidate `ra' */
-    ra = RA(i);
-    lua_assert(base == L->base && L->base == L->ci->base);
-    lua_assert(base <= L->top && L->top <= L->stack + L->stacksize);
-    lua_assert(L->top == L->ci->top || luaG_checkopenop(i));
-    switch (GET_OPCODE(i)) {
-      case OP_MOVE: {
+#endif
+      vmcase(OP_MOVE) {
         setobjs2s(L, ra, RB(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADK: {
+      vmcase(OP_LOADK) {
         setobj2s(L, ra, KBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADBOOL: {
+      vmcase(OP_LOADBOOL) {
         setbvalue(ra, GETARG_B(i));
         if (GETARG_C(i)) pc++;  /* skip next instruction (if C) */
-        continue;
+        vmbreak;
       }
-      case OP_LOADNIL: {
+      vmcase(OP_LOADNIL) {
         TValue *rb = RB(i);
         do {
           setnilvalue(rb--);
         } while (rb >= ra);
-        continue;
+        vmbreak;
       }
-      case OP_GETUPVAL: {
-        int b = GETARG_B(i);
-        setobj2s(L, ra, cl->upvals[b]->v);
-        continue;
+      vmcase(OP_GETUPVAL) {
+        getupval_op(vmbreak);
       }
-      case OP_GETGLOBAL: {
-        TValue g;
-        TValue *rb = KBx(i);
-        sethvalue(L, &g, cl->env);
-        lua_assert(ttisstring(rb));
-        Protect(luaV_gettable(L, &g, rb, ra));
-        continue;
+      vmcase(OP_GETGLOBAL) {
+        getglobal_op(vmbreak);
       }
-      case OP_GETTABLE: {
+      vmcase(OP_GETTABLE) {
+        TValue *v = NULL;
+        if (ttisint(RKC(i))) {
+          arrayfield(v, RB(i), ivalue(RKC(i)));
+        }
+        else if (ISK(GETARG_C(i)) && ttisstring(RKC(i))) {
+          icfield(v, RB(i), RKC(i));
+        }
+        if (v != NULL) {
+          setobj2s(L, ra, v);
+          vmbreak;
+        }
         Protect(luaV_gettable(L, RB(i), RKC(i), ra));
-        continue;
+        vmbreak;
       }
-      case OP_SETGLOBAL: {
+      vmcase(OP_SETGLOBAL) {
         TValue g;
-        sethvalue(L, &g, cl->env);
+        TValue *v;
         lua_assert(ttisstring(KBx(i)));
+        gcfield(v, cl->env, KBx(i));
+        if (v != NULL) {
+          setobj2t(L, v, ra);  /* as luaV_settable does for a non-nil field */
+          cl->env->flags = 0;
+          luaC_barriert(L, cl->env, ra);
+          vmbreak;
+        }
+        sethvalue(L, &g, cl->env);
         Protect(luaV_settable(L, &g, KBx(i), ra));
-        continue;
+        vmbreak;
       }
-      case OP_SETUPVAL: {
+      vmcase(OP_SETUPVAL) {
         UpVal *uv = cl->upvals[GETARG_B(i)];
         setobj(L, uv->v, ra);
         luaC_barrier(L, uv, ra);
-        continue;
+        vmbreak;
       }
-      case OP_SETTABLE: {
+      vmcase(OP_SETTABLE) {
+        TValue *v = NULL;
+        if (ttisint(RKB(i))) {
+          arrayfield(v, ra, ivalue(RKB(i)));
+        }
+        else if (ISK(GETARG_B(i)) && ttisstring(RKB(i))) {
+          icfield(v, ra, RKB(i));
+        }
+        if (v != NULL) {
+          TValue *rc = RKC(i);
+          setobj2t(L, v, rc);  /* as luaV_settable does for a non-nil field */
+          hvalue(ra)->flags = 0;
+          luaC_barriert(L, hvalue(ra), rc);
+          vmbreak;
+        }
         Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
-        continue;
+        vmbreak;
       }
-      case OP_NEWTABLE: {
+      vmcase(OP_NEWTABLE) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         sethvalue(L, ra, luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_SELF: {
-        StkId rb = RB(i);
-        setobjs2s(L, ra+1, rb);
-        Protect(luaV_gettable(L, rb, RKC(i), ra));
-        continue;
+      vmcase(OP_SELF) {
+        self_op(vmbreak);
       }
-      case OP_ADD: {
-        arith_op(luai_numadd, TM_ADD);
-        continue;
+      vmcase(OP_ADD) {
+        arith_op(luai_numadd, intadd, TM_ADD);
+        vmbreak;
       }
-      case OP_SUB: {
-        arith_op(luai_numsub, TM_SUB);
-        continue;
+      vmcase(OP_SUB) {
+        arith_op(luai_numsub, intsub, TM_SUB);
+        vmbreak;
       }
-      case OP_MUL: {
-        arith_op(luai_nummul, TM_MUL);
-        continue;
+      vmcase(OP_MUL) {
+        arith_op(luai_nummul, intmul, TM_MUL);
+        vmbreak;
       }
-      case OP_DIV: {
-        arith_op(luai_numdiv, TM_DIV);
-        continue;
+      vmcase(OP_DIV) {
+        arith_op(luai_numdiv, intnone, TM_DIV);
+        vmbreak;
       }
-      case OP_MOD: {
-        arith_op(luai_nummod, TM_MOD);
-        continue;
+      vmcase(OP_MOD) {
+        arith_op(luai_nummod, intmod, TM_MOD);
+        vmbreak;
       }
-      case OP_POW: {
-        arith_op(luai_numpow, TM_POW);
-        continue;
+      vmcase(OP_POW) {
+        arith_op(luai_numpow, intnone, TM_POW);
+        vmbreak;
       }
-      case OP_UNM: {
+      vmcase(OP_UNM) {
         TValue *rb = RB(i);
-        if (ttisnumber(rb)) {
+        int ri;
+        if (ttisint(rb) && intsub(ri, 0, ivalue(rb)) && ri != 0)
+          setivalue(ra, ri)
+        else if (ttisnumber(rb)) {
           lua_Number nb = nvalue(rb);
           setnvalue(ra, luai_numunm(nb));
         }
         else {
           Protect(Arith(L, ra, rb, rb, TM_UNM));
         }
-        continue;
+        vmbreak;
       }
-      case OP_NOT: {
+      vmcase(OP_NOT) {
         int res = l_isfalse(RB(i));  /* next assignment may change this value */
         setbvalue(ra, res);
-        continue;
+        vmbreak;
       }
-      case OP_LEN: {
+      vmcase(OP_LEN) {
         const TValue *rb = RB(i);
         switch (ttype(rb)) {
           case LUA_TTABLE: {
-            setnvalue(ra, cast_num(luaH_getn(hvalue(rb))));
+            setivalue(ra, luaH_getn(hvalue(rb)));
             break;
           }
           case LUA_TSTRING: {
@@ -529,20 +803,20 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             )
           }
         }
-        continue;
+        vmbreak;
       }
-      case OP_CONCAT: {
+      vmcase(OP_CONCAT) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         Protect(luaV_concat(L, c-b+1, c); luaC_checkGC(L));
         setobjs2s(L, RA(i), base+b);
-        continue;
+        vmbreak;
       }
-      case OP_JMP: {
+      vmcase(OP_JMP) {
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_EQ: {
+      vmcase(OP_EQ) {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
         Protect(
@@ -550,40 +824,40 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LT: {
+      vmcase(OP_LT) {
         Protect(
           if (luaV_lessthan(L, RKB(i), RKC(i)) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LE: {
+      vmcase(OP_LE) {
         Protect(
           if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TEST: {
+      vmcase(OP_TEST) {
         if (l_isfalse(ra) != GETARG_C(i))
           dojump(L, pc, GETARG_sBx(*pc));
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TESTSET: {
+      vmcase(OP_TESTSET) {
         TValue *rb = RB(i);
         if (l_isfalse(rb) != GETARG_C(i)) {
           setobjs2s(L, ra, rb);
           dojump(L, pc, GETARG_sBx(*pc));
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_CALL: {
+      vmcase(OP_CALL) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
@@ -597,14 +871,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             /* it was a C function (`precall' called it); adjust results */
             if (nresults >= 0) L->top = L->ci->top;
             base = L->base;
-            continue;
+            hookcheck(L);
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_TAILCALL: {
+      vmcase(OP_TAILCALL) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
@@ -629,14 +904,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           }
           case PCRC: {  /* it was a C function (`precall' called it) */
             base = L->base;
-            continue;
+            hookcheck(L);
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_RETURN: {
+      vmcase(OP_RETURN) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b-1;
         if (L->openupval) luaF_close(L, base);
@@ -651,19 +927,34 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           goto reentry;
         }
       }
-      case OP_FORLOOP: {
-        lua_Number step = nvalue(ra+2);
-        lua_Number idx = luai_numadd(nvalue(ra), step); /* increment index */
-        lua_Number limit = nvalue(ra+1);
+      vmcase(OP_FORLOOP) {
+        lua_Number step;
+        lua_Number idx;
+        lua_Number limit;
+        /* all three, as debug.setlocal may have changed any of them */
+        if (ttisint(ra) && ttisint(ra+1) && ttisint(ra+2)) {
+          int istep = ivalue(ra+2);
+          int iidx;
+          if (intadd(iidx, ivalue(ra), istep) &&
+              (0 < istep ? iidx <= ivalue(ra+1) : ivalue(ra+1) <= iidx)) {
+            dojump(L, pc, GETARG_sBx(i));  /* jump back */
+            setivalue(ra, iidx);  /* update internal index... */
+            setivalue(ra+3, iidx);  /* ...and external index */
+          }
+          vmbreak;
+        }
+        step = nvalue(ra+2);
+        idx = luai_numadd(nvalue(ra), step); /* increment index */
+        limit = nvalue(ra+1);
         if (luai_numlt(0, step) ? luai_numle(idx, limit)
                                 : luai_numle(limit, idx)) {
           dojump(L, pc, GETARG_sBx(i));  /* jump back */
           setnvalue(ra, idx);  /* update internal index... */
           setnvalue(ra+3, idx);  /* ...and external index */
         }
-        continue;
+        vmbreak;
       }
-      case OP_FORPREP: {
+      vmcase(OP_FORPREP) {
         const TValue *init = ra;
         const TValue *plimit = ra+1;
         const TValue *pstep = ra+2;
@@ -674,11 +965,12 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           luaG_runerror(L, LUA_QL("for") " limit must be a number");
         else if (!tonumber(pstep, ra+2))
           luaG_runerror(L, LUA_QL("for") " step must be a number");
-        setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
+        if (!forint(ra))
+          setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_TFORLOOP: {
+      vmcase(OP_TFORLOOP) {
         StkId cb = ra + 3;  /* call base */
         setobjs2s(L, cb+2, ra+2);
         setobjs2s(L, cb+1, ra+1);
@@ -692,9 +984,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           dojump(L, pc, GETARG_sBx(*pc));  /* jump back */
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_SETLIST: {
+      vmcase(OP_SETLIST) {
         int n = GETARG_B(i);
         int c = GETARG_C(i);
         int last;
@@ -714,13 +1006,13 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           setobj2t(L, luaH_setnum(L, h, last--), val);
           luaC_barriert(L, h, val);
         }
-        continue;
+        vmbreak;
       }
-      case OP_CLOSE: {
+      vmcase(OP_CLOSE) {
         luaF_close(L, ra);
-        continue;
+        vmbreak;
       }
-      case OP_CLOSURE: {
+      vmcase(OP_CLOSURE) {
         Proto *p;
         Closure *ncl;
         int nup, j;
@@ -738,9 +1030,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         }
         setclvalue(L, ra, ncl);
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_VARARG: {
+      vmcase(OP_VARARG) {
         int b = GETARG_B(i) - 1;
         int j;
         CallInfo *ci = L->ci;
@@ -759,7 +1051,16 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             setnilvalue(ra + j);
           }
         }
-        continue;
+        vmbreak;
+      }
+      vmcase(OP_GLOBALFIELD) {
+        getglobal_op(vmnext(OP_GETTABLE));
+      }
+      vmcase(OP_UPVALFIELD) {
+        getupval_op(vmnext(OP_GETTABLE));
+      }
+      vmcase(OP_SELFCALL) {
+        self_op(vmnext(OP_CALL));
       }
     }
   }
@@ -33,4 +33,8 @@ LUAI_FUNC void luaV_settable (lua_State *L, const TValue *t, TValue *key,
 LUAI_FUNC void luaV_execute (lua_State *L, int nexeccalls);
 LUAI_FUNC void luaV_concat (lua_State *L, int total, int last);
 
+#if defined(LUA_COUNT_DISPATCH)
+LUAI_DATA unsigned long luaV_dispatches;
+#endif
+
 #endif
@@ -0,0 +1,161 @@
+/*
+** LZ4 block format codec for bundle sections.
+** A small greedy single-pass compressor and a bounds-checked decoder.
+*/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "lz4.h"
+
+#define HASHLOG		12
+#define MINMATCH	4
+#define MFLIMIT		12	/* last match must start this far from the end */
+#define LASTLITERALS	5	/* ...and stop this far from it */
+
+static uint32_t read32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static unsigned int hash4(uint32_t v){
+    return (v * 2654435761u) >> (32 - HASHLOG);
+}
+
+/* write the extra length bytes that follow a saturated 4-bit field */
+static uint8_t *putlen(uint8_t *op, size_t len){
+    while(len >= 255){
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+int LZ4_compressBound(int isize){
+    return LZ4_COMPRESSBOUND(isize);
+}
+
+int LZ4_compress_default(const char *source, char *dest, int srcSize, int dstCapacity){
+    const uint8_t *src = (const uint8_t *)source;
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend = src + srcSize;
+    uint8_t *op = (uint8_t *)dest;
+    uint8_t *oend = op + dstCapacity;
+    uint32_t htab[1 << HASHLOG];
+    size_t litlen;
+    if(srcSize < 0) return 0;
+    memset(htab,0,sizeof(htab));
+    if(srcSize > MFLIMIT){
+        const uint8_t *mflimit = iend - MFLIMIT;
+        const uint8_t *matchlimit = iend - LASTLITERALS;
+        ip++;
+        while(ip < mflimit){
+            uint32_t seq = read32(ip);
+            unsigned int h = hash4(seq);
+            const uint8_t *ref = src + htab[h];
+            htab[h] = (uint32_t)(ip - src);
+            if(ref >= ip || ip - ref > LZ4_MAXDISTANCE || read32(ref) != seq){
+                ip++;
+                continue;
+            }
+            while(ip > anchor && ref > src && ip[-1] == ref[-1]){  /* extend backwards */
+                ip--;
+                ref--;
+            }
+            const uint8_t *p = ip + MINMATCH;
+            const uint8_t *r = ref + MINMATCH;
+            while(p < matchlimit && *p == *r){
+                p++;
+                r++;
+            }
+            size_t mlen = (size_t)(p - ip) - MINMATCH;
+            unsigned int offset = (unsigned int)(ip - ref);
+            litlen = (size_t)(ip - anchor);
+            if(op + 1 + litlen/255 + 1 + litlen + 2 + mlen/255 + 1 > oend) return 0;
+            uint8_t *token = op++;
+            if(litlen >= 15){
+                *token = 15 << 4;
+                op = putlen(op,litlen - 15);
+            }else{
+                *token = (uint8_t)(litlen << 4);
+            }
+            memcpy(op,anchor,litlen);
+            op += litlen;
+            *op++ = (uint8_t)(offset & 0xff);
+            *op++ = (uint8_t)(offset >> 8);
+            if(mlen >= 15){
+                *token |= 15;
+                op = putlen(op,mlen - 15);
+            }else{
+                *token |= (uint8_t)mlen;
+            }
+            ip = p;
+            anchor = ip;
+            if(ip - 2 > src) htab[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+    litlen = (size_t)(iend - anchor);  /* last literals */
+    if(op + 1 + litlen/255 + 1 + litlen > oend) return 0;
+    if(litlen >= 15){
+        *op++ = 15 << 4;
+        op = putlen(op,litlen - 15);
+    }else{
+        *op++ = (uint8_t)(litlen << 4);
+    }
+    memcpy(op,anchor,litlen);
+    op += litlen;
+    return (int)(op - (uint8_t *)dest);
+}
+
+int LZ4_decompress_safe(const char *source, char *dest, int compressedSize, int dstCapacity){
+    const uint8_t *ip = (const uint8_t *)source;
+    const uint8_t *iend = ip + compressedSize;
+    uint8_t *op = (uint8_t *)dest;
+    uint8_t *ostart = op;
+    uint8_t *oend = op + dstCapacity;
+    if(compressedSize <= 0) return -1;
+    for(;;){
+        if(ip >= iend) return -1;  /* the block ended after a match */
+        unsigned int token = *ip++;
+        size_t len = token >> 4;
+        if(len == 15){
+            unsigned int b;
+            do{
+                if(ip >= iend) return -1;
+                b = *ip++;
+                len += b;
+            }while(b == 255);
+        }
+        if(len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return -1;
+        memcpy(op,ip,len);
+        op += len;
+        ip += len;
+        if(ip == iend) break;  /* the last sequence has no match */
+        if(iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - ostart)) return -1;
+        len = token & 15;
+        if(len == 15){
+            unsigned int b;
+            do{
+                if(ip >= iend) return -1;
+                b = *ip++;
+                len += b;
+            }while(b == 255);
+        }
+        len += MINMATCH;
+        if(len > (size_t)(oend - op)) return -1;
+        const uint8_t *ref = op - offset;
+        if(offset >= len){
+            memcpy(op,ref,len);
+            op += len;
+        }else{
+            while(len--) *op++ = *ref++;  /* overlapping copy repeats the pattern */
+        }
+    }
+    return (int)(op - ostart);
+}
@@ -0,0 +1,31 @@
+/*
+** LZ4 block format codec for bundle sections.
+** Compatible with the reference LZ4 block format, so sections can be
+** produced or inspected with the stock lz4 tools and library.
+*/
+
+#ifndef lz4_h
+#define lz4_h
+
+/* largest output LZ4_compress_default can produce for isize input bytes */
+#define LZ4_COMPRESSBOUND(isize)	((isize) + ((isize) / 255) + 16)
+
+/* window reachable by a match offset */
+#define LZ4_MAXDISTANCE		65535
+
+int LZ4_compressBound(int isize);
+
+/*
+** Compress srcSize bytes of src into dst. Returns the number of bytes
+** written, or 0 if the result does not fit in dstCapacity.
+*/
+int LZ4_compress_default(const char *src, char *dst, int srcSize, int dstCapacity);
+
+/*
+** Decompress a whole block. Never writes past dstCapacity nor reads past
+** compressedSize; returns the decompressed size or a negative value if
+** the block is malformed.
+*/
+int LZ4_decompress_safe(const char *src, char *dst, int compressedSize, int dstCapacity);
+
+#endif
@@ -109,14 +109,17 @@ static void PrintCode(const Proto* f)
     break;
    case OP_GETUPVAL:
    case OP_SETUPVAL:
+   case OP_UPVALFIELD:
     printf("\t; %s", (f->sizeupvalues>0) ? getstr(f->upvalues[b]) : "-");
     break;
    case OP_GETGLOBAL:
    case OP_SETGLOBAL:
+   case OP_GLOBALFIELD:
     printf("\t; %s",svalue(&f->k[bx]));
     break;
    case OP_GETTABLE:
    case OP_SELF:
+   case OP_SELFCALL:
     if (ISK(c)) { printf("\t; "); PrintConstant(f,INDEXK(c)); }
     break;
    case OP_SETTABLE:
@@ -0,0 +1,49 @@
+/*
+** Checks for the LZ4 block decoder on malformed input.
+** Build and run (ideally with -fsanitize=address, which turns any read
+** past the block into a failure):
+**   cc -I.. lz4_test.c ../lz4.c -o lz4_test && ./lz4_test
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+
+static int failures = 0;
+
+/* decode a private copy of n bytes, so an over-read leaves the allocation */
+static int decode(const char *src, int n, char *dst, int cap){
+    char *p = malloc(n > 0 ? n : 1);
+    int r;
+    memcpy(p,src,n);
+    r = LZ4_decompress_safe(p,dst,n,cap);
+    free(p);
+    return r;
+}
+
+static void check(int ok, const char *what){
+    if(!ok){
+        printf("FAIL: %s\n",what);
+        failures++;
+    }
+}
+
+int main(void){
+    /* one literal, then a match; the block ends where a token should be */
+    static const char truncated[] = {0x10, 'a', 0x01, 0x00};
+    char src[4096], packed[LZ4_COMPRESSBOUND(sizeof(src))], out[sizeof(src)];
+    int n, k;
+    for(k = 0;k<(int)sizeof(src);k++) src[k] = "abcabcabd"[k % 9] + (k / 512);
+    check(decode(truncated,sizeof(truncated),out,sizeof(out)) < 0,"block ending after a match");
+    n = LZ4_compress_default(src,packed,sizeof(src),sizeof(packed));
+    check(n > 0,"compress");
+    check(decode(packed,n,out,sizeof(out)) == (int)sizeof(src) &&
+          memcmp(out,src,sizeof(src)) == 0,"round trip");
+    for(k = 1;k<n;k++)  /* every proper prefix is a truncated block */
+        check(decode(packed,k,out,sizeof(out)) != (int)sizeof(src),"truncated prefix");
+    check(decode(packed,n,out,sizeof(src)-1) < 0,"output too small");
+    if(failures == 0) printf("lz4: ok\n");
+    return failures != 0;
+}